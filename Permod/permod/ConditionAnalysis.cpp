@@ -5,8 +5,15 @@
 
 #include "permod/ConditionAnalysis.hpp"
 #include "permod/Condition.hpp"
+#include "permod/ErrnoSummary.hpp"
 #include "permod/OriginFinder.hpp"
+#include "permod/StoreIndex.hpp"
 #include "utils/debug.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/CFG.h"
 
 using namespace llvm;
 
@@ -21,7 +28,14 @@ namespace ConditionAnalysis {
 
 /* Get the latest definition in @TheBB of the allocated value */
 // FIXME: the value is sometimes CallInst, but call analisys can't be applied.
-Value *getLatestValue(AllocaInst &AI, BasicBlock &TheBB) {
+Value *getLatestValue(AllocaInst &AI, BasicBlock &TheBB,
+                      const StoreIndex *Stores) {
+  if (Stores) {
+    if (StoreInst *StoreI = Stores->getLastStore(&AI, TheBB))
+      return StoreI->getValueOperand();
+    return nullptr;
+  }
+
   Value *val = nullptr;
   for (auto &I : TheBB) {
     if (auto *StoreI = dyn_cast<StoreInst>(&I)) {
@@ -39,28 +53,46 @@ Value *getLatestValue(AllocaInst &AI, BasicBlock &TheBB) {
 * code example:
   store i32 %flag, ptr %flag.addr, align 4
   %0 = load i32, ptr %flag.addr, align 4
+* With a cache, the origin is cached for each value on the way. The block of
+* the first value is part of the key, because the latest store is looked up
+* there.
 * TODO: may cause infinite loop
 */
-Value *getOrigin(Value &V) {
+Value *getOrigin(Value &V, const StoreIndex *Stores, OriginCache *Cache) {
+  if (!isa<Instruction>(V))
+    return &V;
+  BasicBlock *TheBB = cast<Instruction>(V).getParent();
+
   OriginFinder OF;
   Value *val = &V;
-
+  SmallVector<Value *, MAX_TRACE_DEPTH> Chain;
   for (int i = 0; i < MAX_TRACE_DEPTH; i++) {
+    if (Cache) {
+      auto It = Cache->find({val, TheBB});
+      if (It != Cache->end()) {
+        val = It->second;
+        break;
+      }
+    }
     DEBUG_PRINT2("getOrigin: " << *val << "\n");
     if (!isa<Instruction>(val)) {
-      return val;
+      break;
     }
+    Chain.push_back(val);
     Value *original = OF.visit(cast<Instruction>(val));
     if (isa<AllocaInst>(val)) {
-      original = getLatestValue(cast<AllocaInst>(*val),
-                                *cast<Instruction>(V).getParent());
+      original = getLatestValue(cast<AllocaInst>(*val), *TheBB, Stores);
     }
     if (!original) {
-      return val;
+      break;
     }
     val = original;
   }
 
+  // Path compression
+  if (Cache)
+    for (Value *Step : Chain)
+      (*Cache)[{Step, TheBB}] = val;
   return val;
 }
 
@@ -78,8 +110,8 @@ StringRef getStructName(GetElementPtrInst &GEPI) {
 /*
  * Get variable name
  */
-StringRef getVarName(Value &V) {
-  StringRef name = getOrigin(V)->getName();
+StringRef getVarName(Value &V, const StoreIndex *Stores, OriginCache *Cache) {
+  StringRef name = getOrigin(V, Stores, Cache)->getName();
   if (name.empty())
     name = NONAME;
   if (name.endswith(".addr"))
@@ -90,294 +122,424 @@ StringRef getVarName(Value &V) {
 }
 
 /*
- * ****************************************************************************
- *                       Anlyzing Conditions
- * ****************************************************************************
+ * Whether the value decides a branch or the return value
+ * Follow the value through casts, compares and local variables
+ * code example:
+  %call = call i32 %0(ptr %inode, i32 %mask)
+  store i32 %call, ptr %error, align 4
+  %1 = load i32, ptr %error, align 4
+  %tobool = icmp ne i32 %1, 0
+  br i1 %tobool, label %if.then, label %if.end
  */
+bool isDecisive(Value &V) {
+  SmallVector<Value *, 8> Worklist = {&V};
+  SmallPtrSet<Value *, 16> Visited;
+
+  while (!Worklist.empty()) {
+    Value *Cur = Worklist.pop_back_val();
+    if (!Visited.insert(Cur).second)
+      continue;
+
+    for (User *U : Cur->users()) {
+      if (isa<BranchInst>(U) || isa<SwitchInst>(U) || isa<ReturnInst>(U))
+        return true;
+      if (auto *StoreI = dyn_cast<StoreInst>(U)) {
+        // Follow the local variable to its loads
+        auto *AI = dyn_cast<AllocaInst>(StoreI->getPointerOperand());
+        if (AI && StoreI->getValueOperand() == Cur) {
+          for (User *AIUser : AI->users())
+            if (isa<LoadInst>(AIUser))
+              Worklist.push_back(AIUser);
+        }
+        continue;
+      }
+      if (isa<CmpInst>(U) || isa<CastInst>(U) || isa<BinaryOperator>(U) ||
+          isa<SelectInst>(U) || isa<PHINode>(U))
+        Worklist.push_back(U);
+    }
+  }
+  return false;
+}
 
 /*
- * Delete all conditions
- * Call this when you continue to next ErrBB
+ * Find the error-thrower blocks, where a value that may be -Errno (also as
+ * ERR_PTR) enters the return value
+    if.then:                                  ; Error-thrower BB
+      store i32 -13, ptr %retval
+ * The return value is followed back through phis, selects, casts and local
+ * variables. A constant is the errno or not; anything else may be.
  */
-void deleteAllCond(CondStack &Conds) {
-  while (!Conds.empty()) {
-    delete Conds.back();
-    Conds.pop_back();
+void findErrorThrowers(Function &F, int64_t Errno,
+                       SmallPtrSetImpl<BasicBlock *> &Throwers,
+                       function_ref<bool(CallBase &)> MayReturnErrno) {
+  // Value and the block where it flows into the return value
+  SmallVector<std::pair<Value *, BasicBlock *>, 8> Worklist;
+  SmallPtrSet<Value *, 16> Visited;
+
+  for (BasicBlock &BB : F)
+    if (auto *RetI = dyn_cast<ReturnInst>(BB.getTerminator()))
+      if (Value *RetVal = RetI->getReturnValue())
+        Worklist.push_back({RetVal, &BB});
+
+  while (!Worklist.empty()) {
+    auto [Cur, Where] = Worklist.pop_back_val();
+    // Constants are checked for each block they come from
+    if (!isa<Constant>(Cur) && !Visited.insert(Cur).second)
+      continue;
+
+    if (auto *CI = dyn_cast<ConstantInt>(Cur)) {
+      if (CI->getSExtValue() == -Errno)
+        Throwers.insert(Where);
+      continue;
+    }
+    if (auto *CE = dyn_cast<ConstantExpr>(Cur)) {
+      // ERR_PTR(-Errno)
+      if (CE->getOpcode() == Instruction::IntToPtr)
+        Worklist.push_back({CE->getOperand(0), Where});
+      else
+        Throwers.insert(Where);
+      continue;
+    }
+    // null, undef or address of a global
+    if (isa<Constant>(Cur))
+      continue;
+
+    if (auto *PN = dyn_cast<PHINode>(Cur)) {
+      for (unsigned i = 0; i < PN->getNumIncomingValues(); i++)
+        Worklist.push_back({PN->getIncomingValue(i), PN->getIncomingBlock(i)});
+      continue;
+    }
+    if (auto *SelI = dyn_cast<SelectInst>(Cur)) {
+      Worklist.push_back({SelI->getTrueValue(), SelI->getParent()});
+      Worklist.push_back({SelI->getFalseValue(), SelI->getParent()});
+      continue;
+    }
+    // Truncation may turn another constant into the errno
+    if (isa<CastInst>(Cur) && !isa<TruncInst>(Cur)) {
+      Worklist.push_back({cast<CastInst>(Cur)->getOperand(0), Where});
+      continue;
+    }
+    if (auto *LoadI = dyn_cast<LoadInst>(Cur)) {
+      // Local variable such as `retval` of -O0 code
+      auto *AI = dyn_cast<AllocaInst>(LoadI->getPointerOperand());
+      if (!AI) {
+        Throwers.insert(Where);
+        continue;
+      }
+      bool Escaped = false;
+      SmallVector<StoreInst *, 8> Stores;
+      for (User *U : AI->users()) {
+        if (isa<LoadInst>(U))
+          continue;
+        auto *StoreI = dyn_cast<StoreInst>(U);
+        if (!StoreI || StoreI->getPointerOperand() != AI)
+          Escaped = true;
+        else
+          Stores.push_back(StoreI);
+      }
+      if (Escaped) {
+        Throwers.insert(Where);
+        continue;
+      }
+      for (StoreInst *StoreI : Stores)
+        Worklist.push_back({StoreI->getValueOperand(), StoreI->getParent()});
+      continue;
+    }
+    // Callee known not to return the errno (see ErrnoSummary)
+    if (auto *CB = dyn_cast<CallBase>(Cur))
+      if (MayReturnErrno && !MayReturnErrno(*CB))
+        continue;
+    // Result of a call, argument, arithmetic...
+    Throwers.insert(Where);
   }
 }
-bool isEmpty(CondStack &Conds) { return Conds.empty(); }
-
-bool isBranchTrue(BranchInst &BrI, BasicBlock &DestBB) {
-  if (BrI.getSuccessor(0) == &DestBB)
-    return true;
-  return false;
-}
 
-std::vector<ArgType> getArgs(CallInst &CallI) {
-  std::vector<ArgType> args;
-  for (auto &arg : CallI.args()) {
-    DEBUG_PRINT2("arg: " << *arg << "\n");
-    StringRef name = getVarName(*arg);
-    if (name.startswith(NONAME) && isa<ConstantInt>(arg)) {
-      args.push_back(cast<ConstantInt>(arg));
-    } else {
-      args.push_back(getVarName(*arg));
+/*
+ * Find the blocks whose branch decides whether an error-thrower is executed
+ * A thrower is reachable from such a branch but doesn't post-dominate it, and
+ * post-dominates one of the successors, i.e., it is control dependent on the
+ * branch. Branches deciding whether these branches run are also decisive.
+ */
+void findDecisiveBranches(PostDominatorTree &PDT,
+                          const SmallPtrSetImpl<BasicBlock *> &Throwers,
+                          SmallPtrSetImpl<BasicBlock *> &Decisive) {
+  SmallVector<BasicBlock *, 16> Targets(Throwers.begin(), Throwers.end());
+  SmallPtrSet<BasicBlock *, 16> Visited(Throwers.begin(), Throwers.end());
+
+  while (!Targets.empty()) {
+    BasicBlock *Target = Targets.pop_back_val();
+
+    // Blocks reaching the target, by walking the predecessors
+    SmallVector<BasicBlock *, 16> Worklist(pred_begin(Target),
+                                           pred_end(Target));
+    SmallPtrSet<BasicBlock *, 32> Reaching;
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      if (!Reaching.insert(BB).second)
+        continue;
+      Worklist.append(pred_begin(BB), pred_end(BB));
+
+      if (PDT.dominates(Target, BB))
+        continue;
+      if (llvm::none_of(successors(BB), [&](BasicBlock *Succ) {
+            return PDT.dominates(Target, Succ);
+          }))
+        continue;
+      Decisive.insert(BB);
+      if (Visited.insert(BB).second)
+        Targets.push_back(BB);
     }
   }
-  return args;
 }
 
-/* Get name & value of if condition
-   - C
-    if (flag & 2) {}     // name:of flag, val:val
-   - IR
-    %and = and i32 %flag, 2
-    %tobool = icmp ne i32 %and, 0
-    br i1 %tobool, label %if.then, label %if.end
+/*
+ * Value of a load from a local variable stored only once in the entry block,
+ * e.g., a parameter at -O0, so that re-tests of it can be matched.
  */
-bool findIfCond_cmp(CondStack &Conds, BranchInst &BrI, CmpInst &CmpI,
-                    BasicBlock &DestBB) {
-  StringRef name;
-  Value *val;
-  CondType type;
-  DEBUG_PRINT2("CMP: " << CmpI << "\n");
-
-  Value *CmpOp = CmpI.getOperand(0);
-  if (!CmpOp)
-    return false;
-
-  Value *CmpOp1 = CmpI.getOperand(1);
-  if (!CmpOp1)
-    return false;
-  /* if cmp with null
-   e.g. if (!inode):
-      %tobool = icmp ne %inode, null
-      br i1 %tobool, label %if.end, label %if.then
-   */
-  if (isa<ConstantPointerNull>(CmpOp1)) {
-    name = getVarName(*CmpOp);
-    val = CmpOp1;
-    type = (isBranchTrue(BrI, DestBB) != CmpI.isFalseWhenEqual()) ? NLLTRU
-                                                                  : NLLFLS;
-    Conds.push_back(new Condition(name, val, type));
-    return true;
+static Value *getStableValue(Value *V) {
+  auto *LoadI = dyn_cast<LoadInst>(V);
+  if (!LoadI)
+    return V;
+  auto *AI = dyn_cast<AllocaInst>(LoadI->getPointerOperand());
+  if (!AI)
+    return V;
+
+  StoreInst *TheStore = nullptr;
+  for (User *U : AI->users()) {
+    if (isa<LoadInst>(U))
+      continue;
+    auto *StoreI = dyn_cast<StoreInst>(U);
+    if (!StoreI || StoreI->getPointerOperand() != AI || TheStore)
+      return V;
+    TheStore = StoreI;
   }
+  if (!TheStore || TheStore->getParent() != &AI->getFunction()->getEntryBlock())
+    return V;
+  // Loads before the store in the entry block see another value
+  if (LoadI->getParent() == TheStore->getParent() &&
+      LoadI->comesBefore(TheStore))
+    return V;
+  return TheStore->getValueOperand();
+}
 
-  // CmpOp: %and = and i32 %flag, 2
-  if (auto *BinI = dyn_cast<BinaryOperator>(CmpOp)) {
-    Value *flag;
-    switch (BinI->getOpcode()) {
-    case Instruction::BinaryOps::And:
-      name = getVarName(*BinI);
-      val = CmpOp1;
-      flag = BinI->getOperand(1);
-      // FIXME: handle more cases
-      switch (CmpI.getPredicate()) {
-      case CmpInst::Predicate::ICMP_EQ:
-        type = ANDTRU;
-        break;
-      case CmpInst::Predicate::ICMP_NE:
-        type = ANDFLS;
-        break;
-      default:
-        DEBUG_PRINT("******* Sorry, Unexpected CmpInst::Predicate\n");
-        DEBUG_PRINT2(CmpI);
-        type = DBINFO;
-        break;
+/*
+ * Find the dominating branch which implies the outcome of the branch
+    if (!inode)                   ; Dominating branch, DomOutcome = false
+      return -EACCES;
+    if (inode && ...)             ; Implied, Outcome = true
+ * The branch must also post-dominate the edge, so that it runs whenever the
+ * edge is taken. Otherwise, e.g., with another `return` between them, the
+ * outcome is known but not whether the branch was reached.
+ * Returns nullptr when the outcome is not implied.
+ */
+BranchInst *findImplyingBranch(BranchInst &BrI, DominatorTree &DT,
+                               PostDominatorTree &PDT, bool &DomOutcome,
+                               bool &Outcome) {
+  auto *CmpI = dyn_cast<ICmpInst>(BrI.getCondition());
+  if (!BrI.isConditional() || !CmpI)
+    return nullptr;
+  const DataLayout &DL = BrI.getModule()->getDataLayout();
+  Value *Op0 = getStableValue(CmpI->getOperand(0));
+  Value *Op1 = getStableValue(CmpI->getOperand(1));
+
+  // Walk up the dominator tree, not too far
+  DomTreeNode *Node = DT.getNode(BrI.getParent());
+  for (int Depth = 0; Node && Depth < 16; Depth++) {
+    Node = Node->getIDom();
+    if (!Node)
+      break;
+    auto *DomBrI = dyn_cast<BranchInst>(Node->getBlock()->getTerminator());
+    if (!DomBrI || !DomBrI->isConditional() ||
+        DomBrI->getSuccessor(0) == DomBrI->getSuccessor(1))
+      continue;
+    auto *DomCmpI = dyn_cast<ICmpInst>(DomBrI->getCondition());
+    if (!DomCmpI)
+      continue;
+
+    // Operands of the compare, as the dominating one reads the same values
+    auto asDomOperand = [&](Value *Op) {
+      for (Value *DomOp : DomCmpI->operands())
+        if (getStableValue(DomOp) == Op)
+          return DomOp;
+      return Op;
+    };
+
+    for (unsigned Succ = 0; Succ < 2; Succ++) {
+      BasicBlockEdge Edge(DomBrI->getParent(), DomBrI->getSuccessor(Succ));
+      if (!DT.dominates(Edge, BrI.getParent()) ||
+          !PDT.dominates(BrI.getParent(), Edge.getEnd()))
+        continue;
+
+      auto Implied =
+          isImpliedCondition(DomCmpI, CmpI->getPredicate(), asDomOperand(Op0),
+                             asDomOperand(Op1), DL, Succ == 0);
+      if (Implied) {
+        DomOutcome = Succ == 0;
+        Outcome = *Implied;
+        return DomBrI;
       }
-      Conds.push_back(new Condition(name, val, type, flag));
-      return true;
-    default:
-      DEBUG_PRINT("\n*************************************\n");
-      DEBUG_PRINT("** Unexpected as BinI: " << *BinI << "\n");
-      DEBUG_PRINT("Function: " << BrI.getFunction()->getName() << "\n");
-      // DEBUG_PRINT2("BB: " << *BrI.getParent() << "\n");
-      DEBUG_PRINT("*************************************\n");
     }
   }
+  return nullptr;
+}
 
-  // CmpOp: %call = call i32 @function()
-  if (auto *CallI = dyn_cast<CallInst>(CmpOp)) {
-    Function *Callee = CallI->getCalledFunction();
-    if (!Callee)
-      return false;
+// Count the path in the merged one, which keeps the thrower if they share it
+static void mergeErrorPath(ErrorPath &Merged, const ErrorPath &Path) {
+  if (Merged.Thrower != Path.Thrower)
+    Merged.Thrower = nullptr;
+  Merged.NumPaths += Path.NumPaths;
+}
 
-    name = getVarName(*Callee);
-    val = ConstantInt::get(Type::getInt32Ty(CallI->getContext()), 0);
-
-    // likely(a)/unlikely(a) macro become 'call llvm.expect(a, 1/0)'
-    /* if (likely(dir_mode & 0002))
-     *
-if.end:                ; preds = %do.end
-  %20 = load i16, ptr %dir_mode, align 2
-  %conv34 = zext i16 %20 to i32
-  %and35 = and i32 %conv34, 2
-  %tobool36 = icmp ne i32 %and35, 0
-  %lnot37 = xor i1 %tobool36, true
-  %lnot39 = xor i1 %lnot37, true
-  %lnot.ext40 = zext i1 %lnot39 to i32
-  %conv41 = sext i32 %lnot.ext40 to i64
-  %expval42 = call i64 @llvm.expect.i64(i64 %conv41, i64 1)
-  %tobool43 = icmp ne i64 %expval42, 0
-  br i1 %tobool43, label %if.then66, label %lor.lhs.false44
-     */
-    if (name.startswith("llvm.expect")) {
-      DEBUG_PRINT2("llvm.expect\n");
-
-      Value *arg1 = CallI->getArgOperand(1);
-      if (!isa<ConstantInt>(arg1)) {
-        DEBUG_PRINT("\n*************************************\n");
-        DEBUG_PRINT("** Unexpected as arg1: " << *arg1 << "\n");
-        DEBUG_PRINT("Function: " << BrI.getFunction()->getName() << "\n");
-        // DEBUG_PRINT2("BB: " << *BrI.getParent() << "\n");
-        DEBUG_PRINT("*************************************\n");
+/*
+ * Enumerate the paths from the entry to the return through an error-thrower
+ * Each path is kept as the outcomes of the recorded conditions on it, which
+ * are the flags the runtime reports when the path is taken.
+   - A select on the path is taken as choosing the errno.
+   - Paths with the same outcomes, e.g., through the cases of a switch, are
+     merged as they are found.
+ * Returns false if the function has a loop or too many paths.
+ */
+bool findErrorPaths(Function &F, int64_t Errno,
+                    const SmallPtrSetImpl<BasicBlock *> &Throwers,
+                    const DenseMap<Instruction *, long long> &CondIDs,
+                    unsigned MaxPaths, std::vector<ErrorPath> &Paths) {
+  auto setBit = [&](ErrorPath &Path, Instruction &I, bool Outcome) {
+    auto It = CondIDs.find(&I);
+    if (It == CondIDs.end() || It->second >= 64)
+      return;
+    Path.Mask |= 1ULL << It->second;
+    if (Outcome)
+      Path.Dst |= 1ULL << It->second;
+  };
+  // Recorded selects in the block, false if the outcome is unknown
+  auto enterBlock = [&](BasicBlock &BB, ErrorPath &Path) {
+    for (Instruction &I : BB) {
+      auto *SelI = dyn_cast<SelectInst>(&I);
+      if (!SelI || !CondIDs.count(SelI))
+        continue;
+      auto *TrueC = dyn_cast<ConstantInt>(SelI->getTrueValue());
+      auto *FalseC = dyn_cast<ConstantInt>(SelI->getFalseValue());
+      bool ToTrue = TrueC && TrueC->getSExtValue() == -Errno;
+      bool ToFalse = FalseC && FalseC->getSExtValue() == -Errno;
+      if (ToTrue == ToFalse)
         return false;
-      }
-      Conds.push_back(new Condition(name, cast<ConstantInt>(arg1), EXPECT));
-
-      Value *arg0 = CallI->getArgOperand(0);
-      arg0 = getOrigin(*arg0);
-
-      if (isa<CmpInst>(arg0)) {
-        // ex: if (likely(a > 0))
-        findIfCond_cmp(Conds, BrI, cast<CmpInst>(*arg0), DestBB);
-      } else if (isa<CallInst>(arg0)) {
-        // ex: if (likely(func()))
-        findIfCond_call(Conds, BrI, cast<CallInst>(*arg0), DestBB);
-      } else {
-        type = cast<ConstantInt>(arg1)->isZero() ? CALFLS : CALTRU;
-        std::vector<ArgType> args = getArgs(*CallI);
-        Conds.push_back(new Condition(getVarName(*arg0), arg1, type, args));
-      }
-
-      return true;
+      setBit(Path, *SelI, ToTrue);
     }
-
-    type = (isBranchTrue(BrI, DestBB) == CmpI.isFalseWhenEqual()) ? CALFLS
-                                                                  : CALTRU;
-    std::vector<ArgType> args = getArgs(*CallI);
-    Conds.push_back(new Condition(name, val, type, args));
     return true;
-  }
+  };
+
+  struct Frame {
+    BasicBlock *BB;
+    unsigned NextSucc;
+    ErrorPath Path;
+  };
+  SmallVector<Frame, 16> Stack = {{&F.getEntryBlock(), 0, {nullptr, 0, 0}}};
+  SmallPtrSet<BasicBlock *, 32> OnStack = {&F.getEntryBlock()};
+  if (!enterBlock(F.getEntryBlock(), Stack.back().Path))
+    return false;
+  DenseMap<std::pair<uint64_t, uint64_t>, unsigned> Index; // Into Paths
+  unsigned Steps = 0;
+
+  while (!Stack.empty()) {
+    Frame &Top = Stack.back();
+    if (!Top.Path.Thrower && Throwers.count(Top.BB))
+      Top.Path.Thrower = Top.BB;
+
+    Instruction *Term = Top.BB->getTerminator();
+    if (Top.NextSucc == Term->getNumSuccessors()) {
+      if (!Top.NextSucc && isa<ReturnInst>(Term) && Top.Path.Thrower) {
+        auto [It, Inserted] = Index.insert(
+            {{Top.Path.Mask, Top.Path.Dst}, (unsigned)Paths.size()});
+        if (!Inserted) {
+          mergeErrorPath(Paths[It->second], Top.Path);
+        } else if (Paths.size() == MaxPaths) {
+          return false;
+        } else {
+          Paths.push_back(Top.Path);
+        }
+      }
+      OnStack.erase(Top.BB);
+      Stack.pop_back();
+      continue;
+    }
 
-  // CmpOp: %1 = load i32, i32* %flag.addr, align 4
-  // TODO: Try on some examples
-  if (auto *LoadI = dyn_cast<LoadInst>(CmpOp)) {
-    name = getVarName(*LoadI);
-    val = CmpI.getOperand(1);
+    // Budget for the diamonds of unrecorded branches
+    if (++Steps > MaxPaths * 256)
+      return false;
 
-    type = (isBranchTrue(BrI, DestBB) == CmpI.isFalseWhenEqual()) ? CMPTRU
-                                                                  : CMPFLS;
-    Conds.push_back(new Condition(name, val, CmpI, isBranchTrue(BrI, DestBB)));
+    unsigned Succ = Top.NextSucc++;
+    BasicBlock *Next = Term->getSuccessor(Succ);
+    if (!OnStack.insert(Next).second)
+      return false;
 
-    return true;
+    // The runtime sets the bit when the first successor is taken
+    ErrorPath Path = Top.Path;
+    setBit(Path, *Term, Succ == 0 && isa<BranchInst>(Term));
+    if (!enterBlock(*Next, Path))
+      return false;
+    Stack.push_back({Next, 0, Path});
   }
-  DEBUG_PRINT("\n*************************************\n");
-  DEBUG_PRINT("** Unexpected as CmpOp: " << *CmpOp << "\n");
-  DEBUG_PRINT("Function: " << BrI.getFunction()->getName() << "\n");
-  DEBUG_PRINT("BB: " << *BrI.getParent() << "\n");
-  DEBUG_PRINT("*************************************\n");
-  return false;
-}
-
-/* Get name & value of if condition
-   - C
-    if (!func()) {}   // name:of func, val:0
-   - IR
-    %call = call i32 @function()
-    br i1 %call, label %if.then, label %if.end
- */
-bool findIfCond_call(CondStack &Conds, BranchInst &BrI, CallInst &CallI,
-                     BasicBlock &DestBB) {
-  StringRef name;
-  Value *val;
-  CondType type;
-
-  Function *Callee = CallI.getCalledFunction();
-  if (!Callee)
-    return false;
-
-  std::vector<ArgType> args = getArgs(CallI);
-  name = getVarName(*Callee);
-  val = ConstantInt::get(Type::getInt32Ty(CallI.getContext()), 0);
-  type = isBranchTrue(BrI, DestBB) ? CALTRU : CALFLS;
-  Conds.push_back(new Condition(name, val, type, args));
   return true;
 }
 
-/* Get name & value of if condition
-   - And condition
-    if (flag & 2) {}
-   - Call condition
-    if (!func()) {}   // name:of func, val:0
+/*
+ * Merge the paths whose recorded conditions have the same outcomes
+ * The runtime can't tell them apart, e.g., when they differ only in a
+ * condition left out. The merged path keeps the outcomes they all share, and
+ * the thrower if they share it.
  */
-bool findIfCond(CondStack &Conds, BranchInst &BrI, BasicBlock &DestBB) {
-
-  // Branch sometimes has only one successor
-  // e.g. br label %if.end
-  if (!BrI.isConditional()) {
-    DEBUG_PRINT2("Not a conditional branch\n");
-    return true;
-  }
-
-  Value *IfCond = BrI.getCondition();
-  if (!IfCond)
-    return false;
-
-  // And condition: if (flag & 2) {}
-  if (isa<CmpInst>(IfCond)) {
-    return findIfCond_cmp(Conds, BrI, cast<CmpInst>(*IfCond), DestBB);
-  }
-  // Call condition: if (!func()) {}
-  if (isa<CallInst>(IfCond)) {
-    return findIfCond_call(Conds, BrI, cast<CallInst>(*IfCond), DestBB);
+void mergeErrorPaths(std::vector<ErrorPath> &Paths, uint64_t Recorded) {
+  std::vector<ErrorPath> Merged;
+  DenseMap<std::pair<uint64_t, uint64_t>, unsigned> Index;
+  for (const ErrorPath &P : Paths) {
+    auto [It, Inserted] = Index.insert(
+        {{P.Mask & Recorded, P.Dst & Recorded}, (unsigned)Merged.size()});
+    if (Inserted) {
+      Merged.push_back(P);
+      continue;
+    }
+    ErrorPath &M = Merged[It->second];
+    M.Mask &= P.Mask & ~(M.Dst ^ P.Dst);
+    M.Dst &= M.Mask;
+    mergeErrorPath(M, P);
   }
-
-  IfCond = getOrigin(*IfCond);
-  DEBUG_PRINT2("IfCond: " << *IfCond << "\n");
-  Conds.push_back(new Condition(getVarName(*IfCond), NULL, SINGLE));
-  return true;
+  Paths = std::move(Merged);
 }
 
-/* Get name & value of switch condition
- * Returns: (StringRef, Value*)
-   - switch (flag) {}     // name:of flag, val:of flag
+/*
+ * Choose the conditions whose outcomes tell the error paths apart
+ * A condition separates two paths if only one of them records it, or they
+ * record different outcomes. Conditions are chosen greedily by the number of
+ * path pairs they separate, until every pair is separated.
  */
-bool findSwCond(CondStack &Conds, SwitchInst &SwI) {
-  StringRef name;
-  Value *val;
-  Value *SwCond = SwI.getCondition();
-
-  // Get value
-  val = SwCond;
-
-  // Get name
-  SwCond = getOrigin(*SwCond);
-  if (!SwCond)
-    return false;
-  name = getVarName(*SwCond);
-
-  Conds.push_back(new Condition(name, val, SWITCH));
-  return true;
-}
-
-bool findConditions(CondStack &Conds, BasicBlock &CondBB, BasicBlock &DestBB) {
-  DEBUG_PRINT2("\n** findConditions **\n");
-
-  // Get Condition
-  /*
-   * if (flag & 2) {}     // name:of flag, val:val
-   * switch (flag) {}     // name:of flag, val:of flag
-   */
-  if (auto *BrI = dyn_cast<BranchInst>(CondBB.getTerminator())) {
-    DEBUG_PRINT2("Pred has BranchInst\n");
-    return findIfCond(Conds, *BrI, DestBB);
-  } else if (auto *SwI = dyn_cast<SwitchInst>(CondBB.getTerminator())) {
-    DEBUG_PRINT2("Pred has SwitchInst\n");
-    return findSwCond(Conds, *SwI);
-  } else {
-    DEBUG_PRINT2("* CondBB terminator is not a branch or switch\n");
-    return false;
+uint64_t findDistinguishingConds(const std::vector<ErrorPath> &Paths) {
+  auto getKey = [](const ErrorPath &P, uint64_t Bits) {
+    return std::make_pair(P.Mask & Bits, P.Dst & Bits);
+  };
+  uint64_t All = 0;
+  for (const ErrorPath &P : Paths)
+    All |= P.Mask;
+
+  uint64_t Chosen = 0;
+  while (true) {
+    unsigned BestSplits = 0;
+    uint64_t Best = 0;
+    for (uint64_t Rest = All & ~Chosen; Rest; Rest &= Rest - 1) {
+      uint64_t Bit = Rest & -Rest;
+      unsigned Splits = 0;
+      for (unsigned i = 0; i < Paths.size(); i++)
+        for (unsigned j = i + 1; j < Paths.size(); j++)
+          if (getKey(Paths[i], Chosen) == getKey(Paths[j], Chosen) &&
+              getKey(Paths[i], Bit) != getKey(Paths[j], Bit))
+            Splits++;
+      if (Splits > BestSplits) {
+        BestSplits = Splits;
+        Best = Bit;
+      }
+    }
+    if (!Best)
+      return Chosen;
+    Chosen |= Best;
   }
 }
 
@@ -402,9 +564,43 @@ void getDebugInfo(DebugInfo &DBinfo, Instruction &I, Function &F) {
   Value *lineVal = ConstantInt::get(Type::getInt32Ty(Ctx), line);
   */
 }
+} // namespace ConditionAnalysis
+
+// ****************************************************************************
+//                               Analysis pass
+// ****************************************************************************
+
+AnalysisKey ConditionAnalysisPass::Key;
 
-void setRetCond(CondStack &Conds, BasicBlock &theBB) {
-  Conds.push_back(new Condition("", NULL, _FUNC_));
+Value *ConditionInfo::getOrigin(Value &V) const {
+  return ConditionAnalysis::getOrigin(V, &Stores, &Origins);
+}
+
+StringRef ConditionInfo::getVarName(Value &V) const {
+  return ConditionAnalysis::getVarName(V, &Stores, &Origins);
+}
+
+ConditionInfo ConditionAnalysisPass::run(Function &F,
+                                         FunctionAnalysisManager &FAM) {
+  ConditionInfo Info;
+  // Summaries of the callees, if computed for the module beforehand
+  const ErrnoSummary *Summary =
+      FAM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+          .getCachedResult<ErrnoSummaryAnalysis>(*F.getParent());
+  ConditionAnalysis::findErrorThrowers(
+      F, Errno, Info.Throwers, [&](CallBase &CB) {
+        return !Summary || Summary->mayReturnErrno(CB);
+      });
+  if (Info.Throwers.empty())
+    return Info;
+  Info.Stores = StoreIndex(F);
+
+  SmallPtrSet<BasicBlock *, 32> Decisive;
+  ConditionAnalysis::findDecisiveBranches(
+      FAM.getResult<PostDominatorTreeAnalysis>(F), Info.Throwers, Decisive);
+  Info.Decisive.insert(Decisive.begin(), Decisive.end());
+  DEBUG_PRINT2("ConditionAnalysis: " << F.getName() << " has "
+                                     << Decisive.size() << " decisive BBs\n");
+  return Info;
 }
-} // namespace ConditionAnalysis
 } // namespace permod
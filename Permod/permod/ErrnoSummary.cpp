@@ -0,0 +1,139 @@
+//===-- ErrnoSummary.cpp - Implement the ErrnoSummaryAnalysis ---------===//
+//
+// Summarize which functions may return the errno
+//
+
+#include "permod/ErrnoSummary.hpp"
+#include "permod/ConditionAnalysis.hpp"
+#include "utils/debug.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace permod {
+
+AnalysisKey ErrnoSummaryAnalysis::Key;
+
+// Entries of the summary file, the last one of a function wins
+static void readSummaryFile(StringRef File, StringMap<bool> &Entries) {
+  auto BufferOrError = MemoryBuffer::getFile(File);
+  if (!BufferOrError)
+    return;
+
+  SmallVector<StringRef, 0> Lines;
+  BufferOrError.get()->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    auto [Name, May] = Line.rsplit(',');
+    if (!Name.empty() && (May == "0" || May == "1"))
+      Entries[Name] = May == "1";
+  }
+}
+
+bool ErrnoSummary::mayReturnErrno(const Function &F) const {
+  auto It = Local.find(F.getName());
+  if (It != Local.end())
+    return It->second;
+  auto ExtIt = External.find(F.getName());
+  if (ExtIt != External.end())
+    return ExtIt->second;
+  // Not compiled yet, or not by us
+  return true;
+}
+
+bool ErrnoSummary::mayReturnErrno(const CallBase &CB) const {
+  // Indirect calls, e.g., LSM hooks, may return anything
+  const Function *Callee = CB.getCalledFunction();
+  return !Callee || mayReturnErrno(*Callee);
+}
+
+/*
+ * Walk the SCCs of the call graph bottom-up
+ * Functions in an SCC are assumed not to return the errno, and the SCC is
+ * summarized again until nothing changes, so recursion doesn't make them may.
+ */
+ErrnoSummary ErrnoSummaryAnalysis::run(Module &M, ModuleAnalysisManager &) {
+  ErrnoSummary Summary;
+  Summary.File = File;
+  readSummaryFile(File, Summary.External);
+
+  auto mayReturn = [&](CallBase &CB) { return Summary.mayReturnErrno(CB); };
+  CallGraph CG(M);
+  for (auto SCC = scc_begin(&CG); !SCC.isAtEnd(); ++SCC) {
+    std::vector<Function *> Funcs;
+    for (CallGraphNode *Node : *SCC) {
+      Function *F = Node->getFunction();
+      if (!F || F->isDeclaration())
+        continue;
+      // Another definition may be linked instead, e.g., of a weak function
+      if (F->isInterposable()) {
+        Summary.Local[F->getName()] = true;
+        continue;
+      }
+      Funcs.push_back(F);
+      Summary.Local[F->getName()] = false;
+    }
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      for (Function *F : Funcs) {
+        if (Summary.Local[F->getName()])
+          continue;
+        SmallPtrSet<BasicBlock *, 8> Throwers;
+        ConditionAnalysis::findErrorThrowers(*F, Errno, Throwers, mayReturn);
+        if (!Throwers.empty())
+          Summary.Local[F->getName()] = Changed = true;
+      }
+    }
+  }
+
+#if defined(DEBUG2)
+  unsigned NumSkipped = llvm::count_if(
+      Summary.Local, [](auto &Entry) { return !Entry.getValue(); });
+  DEBUG_PRINT2("ErrnoSummary: " << NumSkipped << " of " << Summary.Local.size()
+                                << " functions never return the errno\n");
+#endif
+  return Summary;
+}
+
+/*
+ * Rewrite the summary file, with the entries of this module replacing theirs
+ * The file is read again, as other modules may be compiled meanwhile, though
+ * of two modules written at the same time, only one update is kept.
+ * Only functions visible to other modules are kept. Interposable ones are
+ * dropped, as the definition linked in the end may be another one.
+ */
+void ErrnoSummary::store(Module &M) const {
+  StringMap<bool> Entries;
+  readSummaryFile(File, Entries);
+  for (Function &F : M) {
+    if (F.isDeclaration() || F.hasLocalLinkage())
+      continue;
+    if (F.isInterposable())
+      Entries.erase(F.getName());
+    else
+      Entries[F.getName()] = mayReturnErrno(F);
+  }
+
+  std::vector<StringRef> Names;
+  for (auto &Entry : Entries)
+    Names.push_back(Entry.getKey());
+  llvm::sort(Names);
+
+  // Renamed from a temporary file, so readers never see half of it
+  Error Err = writeToOutput(File, [&](raw_ostream &OS) {
+    for (StringRef Name : Names)
+      OS << Name << "," << (Entries.lookup(Name) ? "1" : "0") << "\n";
+    return Error::success();
+  });
+  if (Err)
+    llvm::errs() << "Error writing summary file: " << toString(std::move(Err))
+                 << "\n";
+}
+
+} // namespace permod
@@ -1,7 +1,15 @@
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 #include "permod/Condition.hpp"
 #include "permod/Instrumentation.hpp"
+#include "permod/LogManager.h"
 #include "utils/debug.h"
 #if defined(DEBUG)
 extern const char *condTypeStr[];
@@ -10,6 +18,64 @@ extern const char *condTypeStr[];
 using namespace llvm;
 using namespace permod;
 
+FunctionCallee InstrumentationContext::getBufferFunc() {
+  if (!BufferFunc) {
+    // void buffer_cond(long long *ext, long long *dst, long long nth,
+    //                  long long dest)
+    Type *PtrTy = Type::getInt8PtrTy(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    FunctionType *FuncTy = FunctionType::get(
+        Type::getVoidTy(Ctx), {PtrTy, PtrTy, I64Ty, I64Ty}, false);
+    BufferFunc = M.getOrInsertFunction(BUFFR_FUNC, FuncTy);
+  }
+  return BufferFunc;
+}
+
+FunctionCallee InstrumentationContext::getFlushFunc() {
+  if (!FlushFunc) {
+    // void flush_cond_val(unsigned long long ext, unsigned long long dst,
+    //                     unsigned int funcid, int retval, void *retaddr,
+    //                     void *callee, long long *vals, int nvals,
+    //                     unsigned char *cases, int ncases,
+    //                     unsigned long long *hists, int nhists,
+    //                     long long path_id)
+    Type *PtrTy = Type::getInt8PtrTy(Ctx);
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    FunctionType *FuncTy = FunctionType::get(
+        Type::getVoidTy(Ctx),
+        {I64Ty, I64Ty, I32Ty, I32Ty, PtrTy, PtrTy, PtrTy, I32Ty, PtrTy, I32Ty,
+         PtrTy, I32Ty, I64Ty},
+        false);
+    FlushFunc = M.getOrInsertFunction(FLUSH_VAL_FUNC, FuncTy);
+    // Only called on the error path
+    if (auto *FlushDecl = dyn_cast<Function>(FlushFunc.getCallee()))
+      FlushDecl->addFnAttr(Attribute::Cold);
+  }
+  return FlushFunc;
+}
+
+Function *InstrumentationContext::getRetAddrFunc() {
+  if (!RetAddrFunc)
+    RetAddrFunc = Intrinsic::getDeclaration(&M, Intrinsic::returnaddress);
+  return RetAddrFunc;
+}
+
+// Identical strings share one global in the module
+Constant *InstrumentationContext::getString(StringRef Str) {
+  Constant *&StrPtr = Strings[Str];
+  if (!StrPtr) {
+    Constant *StrConst = ConstantDataArray::getString(Ctx, Str);
+    auto *GV = new GlobalVariable(M, StrConst->getType(), true,
+                                  GlobalValue::PrivateLinkage, StrConst,
+                                  ".permod.str");
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    GV->setAlignment(Align(1));
+    StrPtr = ConstantExpr::getPointerCast(GV, Type::getInt8PtrTy(Ctx));
+  }
+  return StrPtr;
+}
+
 /*
  * Prepare format string
  */
@@ -40,20 +106,69 @@ void Instrumentation::prepFormat() {
   formatStr[_VARS_] = "[Permod] %s\n";
   formatStr[_VARC_] = "[Permod] %d\n";
 
-  for (int i = 0; i < NUM_OF_CONDTYPE; i++) {
-    Value *formatVal = Builder.CreateGlobalStringPtr(formatStr[i]);
-    Format[i] = Builder.CreatePointerCast(formatVal, Type::getInt8PtrTy(Ctx));
-  }
+  for (int i = 0; i < NUM_OF_CONDTYPE; i++)
+    Format[i] = IC.getString(formatStr[i]);
 }
 
 // Ext flag represents whether the condition exists in the runtime path
 // Dst flag represents true or false of the condition
-void Instrumentation::prepFlags() {
+// The flags are as narrow as the number of conditions allows
+void Instrumentation::prepFlags(unsigned NumConds) {
+  unsigned Bits = 8;
+  while (Bits < NUM_OF_FLAGS && Bits < NumConds)
+    Bits *= 2;
+  FlagTy = IntegerType::get(Ctx, Bits);
+
+  Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
+  ExtFlag = Builder.CreateAlloca(FlagTy, nullptr, "ext_list");
+  DstFlag = Builder.CreateAlloca(FlagTy, nullptr, "dst_list");
+  Builder.CreateStore(ConstantInt::get(FlagTy, 0), ExtFlag);
+  Builder.CreateStore(ConstantInt::get(FlagTy, 0), DstFlag);
+  Builder.ClearInsertionPoint();
+}
+
+// Callee slot holds the target of the last indirect call that failed
+void Instrumentation::prepCalleeSlot() {
+  Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
+  CalleeSlot = Builder.CreateAlloca(
+      Type::getInt8PtrTy(Ctx), nullptr, "callee_slot");
+  Builder.CreateStore(
+      ConstantPointerNull::get(Type::getInt8PtrTy(Ctx)), CalleeSlot);
+  Builder.ClearInsertionPoint();
+}
+
+// Value list holds the operands of compares, zeroed not to leak the stack
+void Instrumentation::prepValList() {
+  Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
+  ArrayType *ValListTy = ArrayType::get(Type::getInt64Ty(Ctx), NUM_OF_VALUES);
+  ValList = Builder.CreateAlloca(ValListTy, nullptr, "val_list");
+  Builder.CreateStore(ConstantAggregateZero::get(ValListTy), ValList);
+  Builder.ClearInsertionPoint();
+}
+
+void Instrumentation::prepCaseList() {
+  Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
+  ArrayType *CaseListTy =
+      ArrayType::get(Type::getInt8Ty(Ctx), NUM_OF_CASE_BYTES);
+  CaseList = Builder.CreateAlloca(CaseListTy, nullptr, "case_list");
+  Builder.CreateStore(ConstantAggregateZero::get(CaseListTy), CaseList);
+  Builder.ClearInsertionPoint();
+}
+
+void Instrumentation::prepHistList() {
+  Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
+  ArrayType *HistListTy =
+      ArrayType::get(Type::getInt64Ty(Ctx), NUM_OF_HISTORIES);
+  HistList = Builder.CreateAlloca(HistListTy, nullptr, "hist_list");
+  Builder.CreateStore(ConstantAggregateZero::get(HistListTy), HistList);
+  Builder.ClearInsertionPoint();
+}
+
+// Path register is the sum of the values of the taken edges
+void Instrumentation::prepPathReg() {
   Builder.SetInsertPoint(&TargetFunc->getEntryBlock().front());
-  ExtFlag = Builder.CreateAlloca(Type::getInt64Ty(Ctx), nullptr, "ext_list");
-  DstFlag = Builder.CreateAlloca(Type::getInt64Ty(Ctx), nullptr, "dst_list");
-  Builder.CreateStore(ConstantInt::get(Type::getInt64Ty(Ctx), 0), ExtFlag);
-  Builder.CreateStore(ConstantInt::get(Type::getInt64Ty(Ctx), 0), DstFlag);
+  PathReg = Builder.CreateAlloca(Type::getInt64Ty(Ctx), nullptr, "path_id");
+  Builder.CreateStore(ConstantInt::get(Type::getInt64Ty(Ctx), 0), PathReg);
   Builder.ClearInsertionPoint();
 }
 
@@ -64,24 +179,40 @@ bool Instrumentation::insertBufferFunc(BasicBlock &TheBB, DebugInfo &DBinfo,
 
   // Insert just before the terminator
   Builder.SetInsertPoint(TheBB.getTerminator());
+  if (cond_num < 0 || cond_num >= getNumFlags()) {
+    Builder.ClearInsertionPoint();
+    return false;
+  }
 
-  // Prepare function
-  std::vector<Type *> paramTypes = {};
-  Type *retType = Type::getVoidTy(Ctx);
-  FunctionType *funcType = FunctionType::get(retType, paramTypes, false);
-  FunctionCallee BufferFunc =
-      TargetFunc->getParent()->getOrInsertFunction(BUFFR_FUNC, funcType);
+#if !defined(SSA_MODE)
+  // The runtime works on 64-bit flags
+  if (getNumFlags() == 64) {
+    // Prepare arguments
+    std::vector<Value *> args;
 
-  // Prepare arguments
-  std::vector<Value *> args;
+    /* Instrumentation for Runtime Logging */
+    args.push_back(ExtFlag);
+    args.push_back(DstFlag);
+    args.push_back(ConstantInt::get(Type::getInt64Ty(Ctx), cond_num));
+    // The taken case of switch is recorded by insertCaseCapture()
+    if (isa<SwitchInst>(TheBB.getTerminator()))
+      args.push_back(ConstantInt::get(Type::getInt64Ty(Ctx), 0));
+    else
+      args.push_back(Builder.CreateZExt(TheBB.getTerminator()->getOperand(0),
+                                        Type::getInt64Ty(Ctx)));
+    Builder.CreateCall(IC.getBufferFunc(), args);
+    Builder.ClearInsertionPoint();
+    return true;
+  }
+#endif
 
-  /* Instrumentation for Runtime Logging */
-  args.push_back(ExtFlag);
-  args.push_back(DstFlag);
-  args.push_back(ConstantInt::get(Type::getInt64Ty(Ctx), cond_num));
-  args.push_back(TheBB.getTerminator()->getOperand(0));
-  Builder.CreateCall(BufferFunc, args);
-  args.clear();
+  // Update inline instead of passing the addresses of the flags
+  Value *Outcome = ConstantInt::get(FlagTy, 0);
+  if (!isa<SwitchInst>(TheBB.getTerminator()))
+    Outcome = Builder.CreateShl(
+        Builder.CreateZExt(TheBB.getTerminator()->getOperand(0), FlagTy),
+        cond_num);
+  updateFlags(ConstantInt::get(FlagTy, 1ULL << cond_num), Outcome);
 
   modified = true;
 
@@ -89,6 +220,329 @@ bool Instrumentation::insertBufferFunc(BasicBlock &TheBB, DebugInfo &DBinfo,
   return modified;
 }
 
+/*
+ * Remember the target of an indirect call when it returns an error
+    %call = call i32 %fp(...)
+    %failed = icmp ne i32 %call, 0
+    br i1 %failed, label %callee.fail, label %next   ; unlikely
+  callee.fail:
+    store ptr %fp, ptr %callee_slot
+ */
+bool Instrumentation::insertCalleeCapture(CallInst &CallI) {
+  if (!CallI.isIndirectCall() || !CallI.getType()->isIntegerTy())
+    return false;
+
+  if (!CalleeSlot)
+    prepCalleeSlot();
+
+  Builder.SetInsertPoint(CallI.getNextNode());
+  Value *Failed = Builder.CreateICmpNE(
+      &CallI, ConstantInt::get(CallI.getType(), 0), "callee.failed");
+  MDNode *Weights = MDBuilder(Ctx).createBranchWeights(1, 1000);
+  Instruction *ThenTerm =
+      SplitBlockAndInsertIfThen(Failed, CallI.getNextNode()->getNextNode(),
+                                false, Weights);
+  ThenTerm->getParent()->setName("callee.fail");
+
+  Builder.SetInsertPoint(ThenTerm);
+  Builder.CreateStore(CallI.getCalledOperand(), CalleeSlot);
+  Builder.ClearInsertionPoint();
+  return true;
+}
+
+/*
+ * Store the runtime value of a compared operand into the next free slot
+ * Returns the slot, or -1 when the value is not captured
+ */
+int Instrumentation::insertValueCapture(Instruction &Before, Value &V,
+                                        bool isSigned) {
+  if (isa<Constant>(V) || !V.getType()->isIntegerTy())
+    return -1;
+  if (NumValues >= NUM_OF_VALUES)
+    return -1;
+
+  if (!ValList)
+    prepValList();
+
+  Builder.SetInsertPoint(&Before);
+  Value *Val = Builder.CreateIntCast(&V, Type::getInt64Ty(Ctx), isSigned);
+  Value *Slot = Builder.CreateConstInBoundsGEP2_32(
+      ValList->getAllocatedType(), ValList, 0, NumValues);
+  Builder.CreateStore(Val, Slot);
+  Builder.ClearInsertionPoint();
+  return NumValues++;
+}
+
+/*
+ * Store the index of the taken case on each edge of the switch
+    switch i32 %mode, label %sw.default [ i32 0, label %sw.bb ]
+  becomes
+    switch i32 %mode, label %sw.idx [ i32 0, label %sw.idx1 ]
+  sw.idx:
+    store i8 0, ptr %case.slot
+    br label %sw.default
+  sw.idx1:
+    store i8 1, ptr %case.slot
+    br label %sw.bb
+ * Returns the offset in the case list, or -1 when not captured
+ */
+int Instrumentation::insertCaseCapture(SwitchInst &SwI) {
+  unsigned Width = getCaseWidth(SwI);
+  if (NumCaseBytes + Width > NUM_OF_CASE_BYTES)
+    return -1;
+
+  if (!CaseList)
+    prepCaseList();
+
+  BasicBlock *SwBB = SwI.getParent();
+  Builder.SetInsertPoint(&SwI);
+  Value *Slot = Builder.CreateConstInBoundsGEP1_32(
+      Type::getInt8Ty(Ctx), CaseList, NumCaseBytes, "case.slot");
+  IntegerType *IdxTy = IntegerType::get(Ctx, Width * 8);
+
+  auto insertEdge = [&](BasicBlock *Dest, unsigned Idx) {
+    BasicBlock *EdgeBB =
+        BasicBlock::Create(Ctx, "sw.idx", TargetFunc, Dest);
+    Builder.SetInsertPoint(EdgeBB);
+    Builder.SetCurrentDebugLocation(SwI.getDebugLoc());
+    Builder.CreateStore(ConstantInt::get(IdxTy, Idx), Slot);
+    Builder.CreateBr(Dest);
+    for (PHINode &PN : Dest->phis())
+      PN.addIncoming(PN.getIncomingValueForBlock(SwBB), EdgeBB);
+    return EdgeBB;
+  };
+
+  SmallPtrSet<BasicBlock *, 8> Dests;
+  for (unsigned i = 0; i < SwI.getNumSuccessors(); i++)
+    Dests.insert(SwI.getSuccessor(i));
+
+  SwI.setDefaultDest(insertEdge(SwI.getDefaultDest(), 0));
+  unsigned Idx = 1;
+  for (auto Case : SwI.cases())
+    Case.setSuccessor(insertEdge(Case.getCaseSuccessor(), Idx++));
+
+  // The switch no longer branches to the original destinations
+  for (BasicBlock *Dest : Dests) {
+    for (PHINode &PN : Dest->phis()) {
+      while (PN.getBasicBlockIndex(SwBB) >= 0)
+        PN.removeIncomingValue(SwBB, false);
+    }
+  }
+
+  Builder.ClearInsertionPoint();
+  int Offset = NumCaseBytes;
+  NumCaseBytes += Width;
+  return Offset;
+}
+
+/*
+ * Shift the outcome into the history of the branch and count the iteration
+    hist = ((hist & ~0xffffffff) + (1 << 32)) | ((hist << 1) & 0xffffffff) | cond
+ * Returns the slot in the history list, or -1 when not captured
+ */
+int Instrumentation::insertHistoryUpdate(BranchInst &BrI) {
+  if (!BrI.isConditional() || NumHistories >= NUM_OF_HISTORIES)
+    return -1;
+
+  if (!HistList)
+    prepHistList();
+
+  Builder.SetInsertPoint(&BrI);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Value *Slot = Builder.CreateConstInBoundsGEP2_32(
+      HistList->getAllocatedType(), HistList, 0, NumHistories);
+  Value *Hist = Builder.CreateLoad(Int64Ty, Slot);
+  Value *Count = Builder.CreateAdd(
+      Builder.CreateAnd(Hist, ConstantInt::get(Int64Ty, ~0xffffffffULL)),
+      ConstantInt::get(Int64Ty, 1ULL << 32));
+  Value *Outcomes = Builder.CreateAnd(Builder.CreateShl(Hist, 1),
+                                      ConstantInt::get(Int64Ty, 0xffffffffULL));
+  Outcomes = Builder.CreateOr(
+      Outcomes, Builder.CreateZExt(BrI.getCondition(), Int64Ty));
+  Builder.CreateStore(Builder.CreateOr(Count, Outcomes), Slot);
+  Builder.ClearInsertionPoint();
+  return NumHistories++;
+}
+
+/*
+ * Set the conditions in Mask, with the outcomes in Bits, at the insert point
+    ext |= mask
+    dst = (dst & ~mask) | bits
+ */
+void Instrumentation::updateFlags(Value *Mask, Value *Bits) {
+  Value *Ext = Builder.CreateLoad(FlagTy, ExtFlag);
+  Builder.CreateStore(Builder.CreateOr(Ext, Mask), ExtFlag);
+  Value *Dst = Builder.CreateLoad(FlagTy, DstFlag);
+  Dst = Builder.CreateAnd(Dst, Builder.CreateNot(Mask));
+  Builder.CreateStore(Builder.CreateOr(Dst, Bits), DstFlag);
+}
+
+/*
+ * Record the condition of select without branch
+    ext |= 1 << n
+    dst = (dst & ~(1 << n)) | (zext(cond) << n)
+ */
+bool Instrumentation::insertSelectUpdate(SelectInst &SelI,
+                                         long long cond_num) {
+  if (cond_num < 0 || cond_num >= getNumFlags())
+    return false;
+
+  Builder.SetInsertPoint(&SelI);
+  uint64_t Bit = 1ULL << cond_num;
+
+  Value *Outcome = Builder.CreateShl(
+      Builder.CreateZExt(SelI.getCondition(), FlagTy), cond_num);
+  updateFlags(ConstantInt::get(FlagTy, Bit), Outcome);
+
+  Builder.ClearInsertionPoint();
+  return true;
+}
+
+/*
+ * Update the flags of a short-circuit chain once, when leaving it
+ * The branches before the last evaluated one took the edge to the next
+ * branch, so each exit edge of the chain implies constant flags.
+    br i1 %a, label %land.lhs.true, label %if.end.chain
+  land.lhs.true:
+    br i1 %b, label %if.then.chain, label %if.end.chain
+  if.end.chain:
+    %ext.mask = phi i64 [ 0b01, %entry ], [ 0b11, %land.lhs.true ]
+    %dst.bits = phi i64 [ 0b00, %entry ], [ 0b01, %land.lhs.true ]
+    ; ext |= ext.mask, dst = (dst & ~ext.mask) | dst.bits
+    br label %if.end
+ */
+bool Instrumentation::insertChainUpdate(ArrayRef<BranchInst *> Chain,
+                                        ArrayRef<long long> IDs) {
+  for (long long ID : IDs)
+    if (ID < 0 || ID >= getNumFlags())
+      return false;
+  // Both edges of such a branch would meet in the join with other flags
+  for (BranchInst *BrI : Chain)
+    if (BrI->getSuccessor(0) == BrI->getSuccessor(1))
+      return false;
+
+  // Exit edges of the chain, grouped by the destination
+  struct ExitEdge {
+    BranchInst *BrI;
+    unsigned SuccIdx;
+    uint64_t ExtMask;
+    uint64_t DstBits;
+  };
+  MapVector<BasicBlock *, SmallVector<ExitEdge, 4>> Exits;
+
+  uint64_t ExtMask = 0, DstBits = 0;
+  for (unsigned i = 0; i < Chain.size(); i++) {
+    BranchInst *BrI = Chain[i];
+    uint64_t Bit = 1ULL << IDs[i];
+    ExtMask |= Bit;
+    BasicBlock *Next = i + 1 < Chain.size() ? Chain[i + 1]->getParent() : nullptr;
+    for (unsigned Succ = 0; Succ < 2; Succ++) {
+      if (BrI->getSuccessor(Succ) == Next)
+        continue;
+      Exits[BrI->getSuccessor(Succ)].push_back(
+          {BrI, Succ, ExtMask, DstBits | (Succ == 0 ? Bit : 0)});
+    }
+    // Keep going on the chain
+    if (Next && BrI->getSuccessor(0) == Next)
+      DstBits |= Bit;
+  }
+
+  for (auto &Exit : Exits) {
+    BasicBlock *Dest = Exit.first;
+    BasicBlock *Join = BasicBlock::Create(
+        Ctx, Dest->getName() + ".chain", TargetFunc, Dest);
+    Builder.SetInsertPoint(Join);
+    Builder.SetCurrentDebugLocation(Chain.front()->getDebugLoc());
+    PHINode *ExtPN = Builder.CreatePHI(FlagTy, Exit.second.size(), "ext.mask");
+    PHINode *DstPN = Builder.CreatePHI(FlagTy, Exit.second.size(), "dst.bits");
+
+    // Values flowing into the destination now come through the join
+    for (PHINode &PN : Dest->phis()) {
+      PHINode *NewPN = PHINode::Create(
+          PN.getType(), Exit.second.size(), PN.getName() + ".chain", ExtPN);
+      for (ExitEdge &Edge : Exit.second) {
+        BasicBlock *Pred = Edge.BrI->getParent();
+        NewPN->addIncoming(PN.getIncomingValueForBlock(Pred), Pred);
+      }
+      for (ExitEdge &Edge : Exit.second)
+        PN.removeIncomingValue(Edge.BrI->getParent(), false);
+      PN.addIncoming(NewPN, Join);
+    }
+
+    for (ExitEdge &Edge : Exit.second) {
+      ExtPN->addIncoming(ConstantInt::get(FlagTy, Edge.ExtMask),
+                         Edge.BrI->getParent());
+      DstPN->addIncoming(ConstantInt::get(FlagTy, Edge.DstBits),
+                         Edge.BrI->getParent());
+      Edge.BrI->setSuccessor(Edge.SuccIdx, Join);
+    }
+
+    updateFlags(ExtPN, DstPN);
+    Builder.CreateBr(Dest);
+  }
+
+  Builder.ClearInsertionPoint();
+  return true;
+}
+
+/*
+ * Add the increment of each edge to the path register (PATH_MODE)
+ * Only the chords of the spanning tree have an increment.
+ * The edge is split unless the destination has no other predecessor, and the
+ * increment on the edge to the virtual exit goes before the terminator.
+    br i1 %cmp, label %if.then, label %if.end
+  becomes
+    br i1 %cmp, label %if.then, label %path.edge
+  path.edge:
+    path_id += 1
+    br label %if.end
+ * Must be called before the other instrumentation changes the CFG.
+ */
+bool Instrumentation::insertPathIncrements(const PathNumbering &PN) {
+  if (!PN.isValid())
+    return false;
+
+  if (!PathReg)
+    prepPathReg();
+
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  for (const PathNumbering::Edge &E : PN.edges()) {
+    if (E.Inc == 0)
+      continue;
+
+    Instruction *Term = E.Src->getTerminator();
+    if (!E.Dst) {
+      Builder.SetInsertPoint(Term);
+    } else if (E.Dst->getUniquePredecessor() == E.Src) {
+      Builder.SetInsertPoint(&*E.Dst->getFirstInsertionPt());
+    } else {
+      BasicBlock *EdgeBB =
+          BasicBlock::Create(Ctx, "path.edge", TargetFunc, E.Dst);
+      Builder.SetInsertPoint(EdgeBB);
+      Builder.SetCurrentDebugLocation(Term->getDebugLoc());
+      Instruction *Br = Builder.CreateBr(E.Dst);
+      // All the edges of a switch to the destination go through EdgeBB
+      for (unsigned i = 0; i < Term->getNumSuccessors(); i++)
+        if (Term->getSuccessor(i) == E.Dst)
+          Term->setSuccessor(i, EdgeBB);
+      for (PHINode &Phi : E.Dst->phis()) {
+        Value *In = Phi.getIncomingValueForBlock(E.Src);
+        while (Phi.getBasicBlockIndex(E.Src) >= 0)
+          Phi.removeIncomingValue(E.Src, false);
+        Phi.addIncoming(In, EdgeBB);
+      }
+      Builder.SetInsertPoint(Br);
+    }
+    Value *Path = Builder.CreateLoad(Int64Ty, PathReg);
+    Builder.CreateStore(
+        Builder.CreateAdd(Path, ConstantInt::get(Int64Ty, E.Inc, true)),
+        PathReg);
+  }
+
+  Builder.ClearInsertionPoint();
+  return true;
+}
+
 bool Instrumentation::insertFlushFunc(DebugInfo &DBinfo, BasicBlock &TheBB) {
 
   DEBUG_PRINT2("\n...Inserting flush function...\n");
@@ -105,23 +559,114 @@ bool Instrumentation::insertFlushFunc(DebugInfo &DBinfo, BasicBlock &TheBB) {
     return false;
   }
 
+  // Return value as errno, e.g., -13 or ERR_PTR(-13)
   Builder.SetInsertPoint(TermInst);
+  Value *RetVal = TermInst->getOperand(0);
+  if (RetVal->getType()->isPointerTy())
+    RetVal = Builder.CreatePtrToInt(RetVal, Type::getInt64Ty(Ctx));
+  if (!RetVal->getType()->isIntegerTy()) {
+    DEBUG_PRINT("** Terminator " << *TermInst << " doesn't return errno\n");
+    Builder.ClearInsertionPoint();
+    return false;
+  }
+  // Compared at full width, so a long whose low half is -13 is no error
+  RetVal = Builder.CreateSExtOrTrunc(RetVal, Type::getInt64Ty(Ctx));
 
-  // Prepare function
-  std::vector<Type *> paramTypes = {};
-  Type *retType = Type::getVoidTy(Ctx);
-  FunctionType *funcType = FunctionType::get(retType, paramTypes, false);
-  FunctionCallee FlushFunc =
-      TargetFunc->getParent()->getOrInsertFunction(FLUSH_FUNC, funcType);
+  /*
+   * Keep the logging out of the success path
+      %is.err = icmp eq i64 %retval, -13
+      br i1 %is.err, label %permod.flush, label %return   ; unlikely
+    permod.flush:                                         ; cold
+      call void @flush_cond_val(...)
+   */
+  Value *IsErr =
+      Builder.CreateICmpEQ(RetVal, Builder.getInt64(-TRACKED_ERRNO), "is.err");
+  Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+      IsErr, TermInst, false, MDBuilder(Ctx).createBranchWeights(1, 1000));
+  ThenTerm->getParent()->setName("permod.flush");
+  TermInst->getParent()->setName("permod.ret");
+  Builder.SetInsertPoint(ThenTerm);
 
   std::vector<Value *> args;
-  args.push_back(ExtFlag);
-  args.push_back(DstFlag);
-  args.push_back(Builder.CreateGlobalStringPtr(DBinfo.first));
-  args.push_back(Builder.CreateGlobalStringPtr(DBinfo.second));
-  args.push_back(TermInst->getOperand(0)); // Return value
+  // Flags are passed by value, so their addresses don't escape
+  args.push_back(Builder.CreateZExt(Builder.CreateLoad(FlagTy, ExtFlag),
+                                    Type::getInt64Ty(Ctx)));
+  args.push_back(Builder.CreateZExt(Builder.CreateLoad(FlagTy, DstFlag),
+                                    Type::getInt64Ty(Ctx)));
+  args.push_back(Builder.getInt32(LogManager::getFuncID(DBinfo.first,
+                                                        DBinfo.second)));
+  // Return value, which is the errno here
+  args.push_back(Builder.CreateTrunc(RetVal, Type::getInt32Ty(Ctx)));
+
+  // Return address tells which caller reached this function
+  args.push_back(Builder.CreateCall(IC.getRetAddrFunc(), Builder.getInt32(0)));
+
+  // Indirect callee which returned the error, if any
+  if (CalleeSlot)
+    args.push_back(Builder.CreateLoad(Type::getInt8PtrTy(Ctx), CalleeSlot));
+  else
+    args.push_back(ConstantPointerNull::get(Type::getInt8PtrTy(Ctx)));
+
+  // Values of compared operands
+  if (ValList)
+    args.push_back(ValList);
+  else
+    args.push_back(ConstantPointerNull::get(Type::getInt8PtrTy(Ctx)));
+  args.push_back(Builder.getInt32(NumValues));
 
-  Builder.CreateCall(FlushFunc, args);
+  // Taken case index of switches
+  if (CaseList)
+    args.push_back(CaseList);
+  else
+    args.push_back(ConstantPointerNull::get(Type::getInt8PtrTy(Ctx)));
+  args.push_back(Builder.getInt32(NumCaseBytes));
+
+  // Outcome histories of branches in loops
+  if (HistList)
+    args.push_back(HistList);
+  else
+    args.push_back(ConstantPointerNull::get(Type::getInt8PtrTy(Ctx)));
+  args.push_back(Builder.getInt32(NumHistories));
+
+  // Path ID, or -1 when the branches are recorded in the flags
+  if (PathReg)
+    args.push_back(Builder.CreateLoad(Type::getInt64Ty(Ctx), PathReg));
+  else
+    args.push_back(Builder.getInt64(-1));
+
+  CallInst *FlushCall = Builder.CreateCall(IC.getFlushFunc(), args);
+  FlushCall->addFnAttr(Attribute::Cold);
+  Builder.ClearInsertionPoint();
   modified = true;
   return modified;
 }
+
+/*
+ * Turn the flags into SSA values threaded through phis (SSA_MODE)
+ * Their addresses must not escape, i.e., only loads and stores use them.
+ */
+bool Instrumentation::promoteFlags() {
+  std::vector<AllocaInst *> Allocas;
+  for (AllocaInst *AI : {ExtFlag, DstFlag, PathReg})
+    if (AI && isAllocaPromotable(AI))
+      Allocas.push_back(AI);
+  if (Allocas.empty())
+    return false;
+
+  // The CFG was changed by the instrumentation
+  DominatorTree DT(*TargetFunc);
+  PromoteMemToReg(Allocas, DT);
+  ExtFlag = DstFlag = PathReg = nullptr;
+  return true;
+}
+
+// Bytes of stack added to the frame by the instrumentation
+unsigned Instrumentation::getStackSize() {
+  const DataLayout &DL = TargetFunc->getParent()->getDataLayout();
+  unsigned Size = 0;
+  for (AllocaInst *AI :
+       {ExtFlag, DstFlag, CalleeSlot, ValList, CaseList, HistList, PathReg})
+    if (AI)
+      Size += DL.getTypeAllocSize(AI->getAllocatedType());
+  return Size;
+}
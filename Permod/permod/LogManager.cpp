@@ -1,4 +1,7 @@
 #include "permod/LogManager.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/xxhash.h"
 
 namespace permod {
 
@@ -22,6 +25,11 @@ LogManager &LogManager::getInstance() {
   return Instance;
 }
 
+// Same for every translation unit, so logs of the whole kernel can be merged
+uint32_t LogManager::getFuncID(StringRef FileName, StringRef FuncName) {
+  return static_cast<uint32_t>(xxHash64((FileName + ":" + FuncName).str()));
+}
+
 // Add a log entry
 void LogManager::addEntry(StringRef FileName, unsigned LineNumber,
                           StringRef FuncName, StringRef EventType,
@@ -33,7 +41,8 @@ void LogManager::addEntry(StringRef FileName, unsigned LineNumber,
                   EventType.str(),
                   CondID,
                   Content.str(),
-                  ExtraInfo.str()});
+                  ExtraInfo.str(),
+                  getFuncID(FileName, FuncName)});
 }
 
 // Write logs to CSV
@@ -48,7 +57,7 @@ void LogManager::writeAllLogs(bool SortByLocation) {
     return;
   }
 
-  OS << "File,Line,Function,EventType,ID,Content,ExtraInfo\n";
+  OS << "File,Line,Function,EventType,ID,Content,ExtraInfo,FuncID\n";
 
   std::sort(Logs.begin(), Logs.end(), [](const LogEntry &A, const LogEntry &B) {
     if (A.FileName != B.FileName)
@@ -66,7 +75,8 @@ void LogManager::writeAllLogs(bool SortByLocation) {
        << escapeCSV(Entry.EventType) << ","
        << Entry.CondID << ","
        << escapeCSV(Entry.Content) << ","
-       << escapeCSV(Entry.ExtraInfo)
+       << escapeCSV(Entry.ExtraInfo) << ","
+       << format_hex_no_prefix(Entry.FuncID, 8)
        << "\n";
     // clang-format on
   }
@@ -0,0 +1,153 @@
+//===-- PathNumbering.cpp - Implement the Ball-Larus path numbering ---===//
+//
+// Number the paths from the entry to the exits of an acyclic function
+//
+
+#include "permod/PathNumbering.hpp"
+#include "utils/debug.h"
+#include "llvm/ADT/IntEqClasses.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/CFG.h"
+
+using namespace llvm;
+
+namespace permod {
+
+// Path IDs are passed to the runtime as long long
+#define MAX_NUM_PATHS (1ULL << 62)
+
+PathNumbering::PathNumbering(Function &F, BlockFrequencyInfo *BFI,
+                             BranchProbabilityInfo *BPI) {
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    Index[BB] = Blocks.size();
+    Blocks.push_back(BB);
+  }
+
+  /*
+   * NumPaths(v) = 1 for an exit, or the sum of NumPaths(w) of successors
+   * Val(v->w) = the number of paths through the preceding successors of v
+   */
+  for (auto It = Blocks.rbegin(); It != Blocks.rend(); ++It) {
+    BasicBlock *BB = *It;
+    SetVector<BasicBlock *> Succs(succ_begin(BB), succ_end(BB));
+    uint64_t Paths = 0;
+    for (BasicBlock *Succ : Succs) {
+      // Back edge
+      if (Index.lookup(Succ) <= Index.lookup(BB)) {
+        DEBUG_PRINT2("PathNumbering: " << F.getName() << " has a loop\n");
+        return;
+      }
+      Edges.push_back({BB, Succ, Paths, 0});
+      Paths += NumPaths[Succ];
+      if (Paths > MAX_NUM_PATHS) {
+        DEBUG_PRINT2("PathNumbering: " << F.getName() << " has too many paths\n");
+        return;
+      }
+    }
+    if (Succs.empty())
+      Edges.push_back({BB, nullptr, 0, 0});
+    NumPaths[BB] = Succs.empty() ? 1 : Paths;
+  }
+  placeIncrements(BFI, BPI);
+  Valid = true;
+}
+
+/*
+ * Move the values onto the chords of a maximum spanning tree (Ball-Larus)
+ * The tree includes the virtual edge from the exit to the entry.
+ * With a potential P where P(v) = P(u) + Val(u->v) on the tree edges,
+ *   Inc(u->v) = Val(u->v) + P(u) - P(v)
+ * is 0 on the tree edges and sums up to the same path ID on any path.
+ * The tree is weighted by the edge frequency, so the hot edges are free.
+ */
+void PathNumbering::placeIncrements(BlockFrequencyInfo *BFI,
+                                    BranchProbabilityInfo *BPI) {
+  unsigned Exit = Blocks.size();
+  auto getNode = [&](BasicBlock *BB) { return BB ? getIndex(BB) : Exit; };
+  auto getWeight = [&](const Edge &E) -> uint64_t {
+    if (!BFI)
+      return 0;
+    uint64_t Freq = BFI->getBlockFreq(E.Src).getFrequency();
+    if (!E.Dst || !BPI)
+      return Freq;
+    return BPI->getEdgeProbability(E.Src, E.Dst).scale(Freq);
+  };
+
+  std::vector<unsigned> Order(Edges.size());
+  std::vector<uint64_t> Weights(Edges.size());
+  for (unsigned i = 0; i < Edges.size(); i++) {
+    Order[i] = i;
+    Weights[i] = getWeight(Edges[i]);
+  }
+  std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+    return Weights[A] > Weights[B];
+  });
+
+  // Kruskal
+  IntEqClasses Trees(Exit + 1);
+  Trees.join(getNode(Blocks.front()), Exit);
+  std::vector<std::vector<std::pair<unsigned, int64_t>>> Tree(Exit + 1);
+  std::vector<bool> IsTree(Edges.size());
+  for (unsigned i : Order) {
+    unsigned Src = getNode(Edges[i].Src), Dst = getNode(Edges[i].Dst);
+    if (Trees.findLeader(Src) == Trees.findLeader(Dst))
+      continue;
+    Trees.join(Src, Dst);
+    IsTree[i] = true;
+    Tree[Src].push_back({Dst, Edges[i].Val});
+    Tree[Dst].push_back({Src, -(int64_t)Edges[i].Val});
+  }
+
+  // The virtual edge from the exit to the entry has no value
+  std::vector<int64_t> Potential(Exit + 1);
+  std::vector<bool> Visited(Exit + 1);
+  std::vector<unsigned> Worklist = {getNode(Blocks.front()), Exit};
+  Visited[getNode(Blocks.front())] = Visited[Exit] = true;
+  while (!Worklist.empty()) {
+    unsigned Node = Worklist.back();
+    Worklist.pop_back();
+    for (auto &Next : Tree[Node]) {
+      if (Visited[Next.first])
+        continue;
+      Visited[Next.first] = true;
+      Potential[Next.first] = Potential[Node] + Next.second;
+      Worklist.push_back(Next.first);
+    }
+  }
+
+  for (unsigned i = 0; i < Edges.size(); i++) {
+    Edge &E = Edges[i];
+    E.Inc = IsTree[i] ? 0
+                      : (int64_t)E.Val + Potential[getNode(E.Src)] -
+                            Potential[getNode(E.Dst)];
+  }
+}
+
+std::string PathNumbering::getSuccInfo(Instruction &Term) const {
+  std::string Info = std::to_string(getIndex(Term.getParent())) + ">";
+  for (unsigned i = 0; i < Term.getNumSuccessors(); i++)
+    Info += std::to_string(getIndex(Term.getSuccessor(i))) + ",";
+  Info.pop_back();
+  return Info;
+}
+
+std::string PathNumbering::str() const {
+  std::string Str;
+  BasicBlock *Prev = nullptr;
+  // Edges are grouped by the source
+  for (const Edge &E : Edges) {
+    if (!E.Dst)
+      continue;
+    if (E.Src != Prev)
+      Str += (Str.empty() ? "" : " ") + std::to_string(getIndex(E.Src)) + ">";
+    else
+      Str += ",";
+    Str += std::to_string(getIndex(E.Dst)) + "@" + std::to_string(E.Val);
+    Prev = E.Src;
+  }
+  return Str;
+}
+
+} // namespace permod
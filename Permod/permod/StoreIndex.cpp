@@ -0,0 +1,33 @@
+//===-- StoreIndex.cpp - Implement the StoreIndex ---------------------===//
+//
+// Index the stores of a function by the pointer operand
+//
+
+#include "permod/StoreIndex.hpp"
+
+using namespace llvm;
+
+namespace permod {
+
+StoreIndex::StoreIndex(Function &F) {
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (auto *StoreI = dyn_cast<StoreInst>(&I))
+        Stores[StoreI->getPointerOperand()].push_back(StoreI);
+}
+
+ArrayRef<StoreInst *> StoreIndex::getStores(Value *Ptr) const {
+  auto It = Stores.find(Ptr);
+  if (It == Stores.end())
+    return {};
+  return It->second;
+}
+
+StoreInst *StoreIndex::getLastStore(Value *Ptr, BasicBlock &BB) const {
+  for (StoreInst *StoreI : llvm::reverse(getStores(Ptr)))
+    if (StoreI->getParent() == &BB)
+      return StoreI;
+  return nullptr;
+}
+
+} // namespace permod
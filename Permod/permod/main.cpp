@@ -1,19 +1,30 @@
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 
 #include "macker/LogManager.h"
 #include "permod/ConditionAnalysis.hpp"
+#include "permod/ErrnoSummary.hpp"
 #include "permod/Instrumentation.hpp"
 #include "permod/LogManager.h"
 #include "permod/LogParser.h"
 #include "utils/debug.h"
 
-#include <queue>
-#include <unordered_set>
-
 using namespace llvm;
 
+// Paths to the error returns kept in the reason catalog of a function
+#define MAX_ERROR_PATHS 64
+
 namespace {
 
 /*
@@ -39,65 +50,414 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
   PermodPass(PermodPass &&) = default;
   PermodPass &operator=(PermodPass &&) = default;
 
-  std::queue<unsigned> LineNumQueue;       // FIFO queue for LineNum
-  std::unordered_set<unsigned> LineNumSet; // Set to track duplicates
-
-  void traceValue(Value *V, int depth = 0) {
-    if (!V)
-      return;
-    if (depth > 10)
-      return; // Prevent infinite recursion
-
-    if (auto *inst = dyn_cast<Instruction>(V)) {
-      if (DebugLoc DL = inst->getDebugLoc()) {
-        unsigned LineNum = DL->getLine();
-        // print with depth
-        DEBUG_PRINT2(std::string(depth * 2, ' ')
-                     << "Line: " << LineNum << *V << "\n");
-
-        if (LineNumSet.find(LineNum) == LineNumSet.end()) {
-          // Add LineNum to FIFO if not already present
-          LineNumQueue.push(LineNum);
-          LineNumSet.insert(LineNum);
-        }
-      }
-    }
+  DenseMap<Value *, std::vector<unsigned>> TraceMemo; // Lines of the values
+  MemorySSA *MSSA = nullptr; // Of the function before instrumentation
+  const ConditionInfo *CondInfo = nullptr; // Of the function being processed
 
+  // Values the value is computed from, in the order of tracing
+  void getTraceOperands(Value *V, SmallVectorImpl<Value *> &Ops) {
     if (auto *icmp = dyn_cast<ICmpInst>(V)) {
       /* Trace each operands of cmp inst */
-      traceValue(icmp->getOperand(0), depth + 1);
-      traceValue(icmp->getOperand(1), depth + 1);
+      Ops.push_back(icmp->getOperand(0));
+      Ops.push_back(icmp->getOperand(1));
     } else if (auto *load = dyn_cast<LoadInst>(V)) {
       /* Find store inst for the pointer operand of the load inst */
-      Value *ptr = load->getPointerOperand();
-      findLastStore(ptr, *load->getFunction(), depth + 1);
+      findReachingStores(*load, Ops);
+    } else if (auto *store = dyn_cast<StoreInst>(V)) {
+      /* The assignment reaching a load */
+      Ops.push_back(store->getValueOperand());
+    } else if (auto *gep = dyn_cast<GetElementPtrInst>(V)) {
+      /* `inode->i_mode` is traced to `inode` */
+      Ops.push_back(gep->getPointerOperand());
     } else if (auto *call = dyn_cast<CallInst>(V)) {
       /* TODO: trace each argument */
-      // errs() << std::string(depth * 2, ' ')
-      //        << "Function call: " << call->getCalledFunction()->getName()
-      //        << "\n";
     } else if (auto *binop = dyn_cast<BinaryOperator>(V)) {
-      traceValue(binop->getOperand(0), depth + 1);
-      traceValue(binop->getOperand(1), depth + 1);
+      Ops.push_back(binop->getOperand(0));
+      Ops.push_back(binop->getOperand(1));
     } else if (isa<Constant>(V)) {
       /* Do Nothing */
     }
   }
 
-  void findLastStore(Value *ptr, Function &F, int depth) {
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        if (auto *store = dyn_cast<StoreInst>(&I)) {
-          if (store->getPointerOperand() == ptr) {
-            traceValue(store->getValueOperand(), depth);
-          }
+  /*
+   * Stores to the loaded location on the paths reaching the load
+   * The clobbering definitions are walked on MemorySSA, which skips the
+   * stores to other variables or fields. If the location may be set before
+   * the function, the pointer is traced instead, e.g., to the argument.
+   */
+  void findReachingStores(LoadInst &LoadI, SmallVectorImpl<Value *> &Ops) {
+    MemorySSAWalker *Walker = MSSA->getWalker();
+    MemoryLocation Loc = MemoryLocation::get(&LoadI);
+    SmallVector<MemoryAccess *, 8> Worklist = {
+        Walker->getClobberingMemoryAccess(&LoadI)};
+    SmallPtrSet<MemoryAccess *, 8> Visited;
+    bool FromEntry = false;
+
+    while (!Worklist.empty()) {
+      MemoryAccess *MA = Worklist.pop_back_val();
+      if (!Visited.insert(MA).second)
+        continue;
+      if (MSSA->isLiveOnEntryDef(MA)) {
+        FromEntry = true;
+      } else if (auto *Phi = dyn_cast<MemoryPhi>(MA)) {
+        for (Use &Incoming : Phi->incoming_values())
+          Worklist.push_back(Walker->getClobberingMemoryAccess(
+              cast<MemoryAccess>(Incoming), Loc));
+      } else if (auto *Def = dyn_cast<MemoryDef>(MA)) {
+        // Store, or a call or memcpy setting the location
+        Ops.push_back(Def->getMemoryInst());
+      }
+    }
+    if (FromEntry)
+      Ops.push_back(LoadI.getPointerOperand());
+  }
+
+  /*
+   * Lines of the value and the values it is computed from, without duplicates
+   * The def-use graph is walked once with a worklist, and the lines of each
+   * value are memoized for the function. Values on a cycle (e.g., `i++` in a
+   * loop) miss the lines of the value closing it, so they are not memoized.
+   */
+  const std::vector<unsigned> &traceValue(Value *Root) {
+    if (auto It = TraceMemo.find(Root); It != TraceMemo.end())
+      return It->second;
+
+    struct Frame {
+      Value *V;
+      SmallVector<Value *, 4> Ops;
+      unsigned NextOp;
+    };
+    std::vector<Frame> Stack;
+    SmallPtrSet<Value *, 16> OnStack;
+    DenseMap<Value *, std::vector<unsigned>> Partial; // Values on a cycle
+    auto lookup = [&](Value *V) -> const std::vector<unsigned> * {
+      if (auto It = TraceMemo.find(V); It != TraceMemo.end())
+        return &It->second;
+      if (auto It = Partial.find(V); It != Partial.end())
+        return &It->second;
+      return nullptr;
+    };
+    auto push = [&](Value *V) {
+      Stack.push_back({V, {}, 0});
+      getTraceOperands(V, Stack.back().Ops);
+      OnStack.insert(V);
+    };
+
+    push(Root);
+    while (true) {
+      Frame &Top = Stack.back();
+      if (Top.NextOp < Top.Ops.size()) {
+        Value *Op = Top.Ops[Top.NextOp++];
+        if (!OnStack.count(Op) && !lookup(Op))
+          push(Op);
+        continue;
+      }
+
+      // All the operands are traced
+      std::vector<unsigned> Lines;
+      DenseSet<unsigned> Seen;
+      bool OnCycle = false;
+      if (auto *inst = dyn_cast<Instruction>(Top.V))
+        if (DebugLoc DL = inst->getDebugLoc()) {
+          Lines.push_back(DL->getLine());
+          Seen.insert(DL->getLine());
         }
+      for (Value *Op : Top.Ops) {
+        OnCycle |= OnStack.count(Op) || Partial.count(Op);
+        if (const std::vector<unsigned> *OpLines = lookup(Op))
+          for (unsigned LineNum : *OpLines)
+            if (Seen.insert(LineNum).second)
+              Lines.push_back(LineNum);
       }
+
+      Value *V = Top.V;
+      OnStack.erase(V);
+      Stack.pop_back();
+      if (Stack.empty() || !OnCycle) {
+        DEBUG_PRINT2("Traced " << Lines.size() << " lines: " << *V << "\n");
+        auto &Memo = TraceMemo[V];
+        Memo = std::move(Lines);
+        if (Stack.empty())
+          return Memo;
+      } else {
+        Partial[V] = std::move(Lines);
+      }
+    }
+  }
+
+  // Condition to log, found before the function is changed
+  struct CondSite {
+    Instruction *I;         // Select, branch or switch
+    std::string CondType;   // e.g., "if" or "switch"
+    unsigned LineNum = 0;
+    std::string LineNumStr; // Lines the condition is traced to
+    SmallVector<std::pair<Value *, std::string>, 2> Operands; // To capture
+    std::string PathInfo;   // "bb=..." to decode the path ID
+    bool InLoop = false;
+  };
+
+  /*
+   * Operands of the compare to capture at runtime, with their names
+     - `(mode & S_IFMT) == S_IFDIR` captures `mode` instead of the masked value
+   */
+  void findCapturedOperands(
+      ICmpInst &CmpI,
+      SmallVectorImpl<std::pair<Value *, std::string>> &Operands) {
+    for (Value *Op : CmpI.operands()) {
+      if (auto *BinI = dyn_cast<BinaryOperator>(Op)) {
+        if (BinI->getOpcode() == Instruction::And &&
+            isa<Constant>(BinI->getOperand(1)))
+          Op = BinI->getOperand(0);
+      }
+      if (isa<Constant>(Op) || !Op->getType()->isIntegerTy())
+        continue;
+      Operands.push_back({Op, CondInfo->getVarName(*Op).str()});
+    }
+  }
+
+  CondSite findSelectSite(SelectInst &SelI) {
+    CondSite Site;
+    Site.I = &SelI;
+    Site.CondType = "select";
+    Site.LineNum = SelI.getDebugLoc().getLine();
+    Site.LineNumStr = traceLines(SelI.getCondition());
+    if (auto *CmpI = dyn_cast<ICmpInst>(SelI.getCondition()))
+      findCapturedOperands(*CmpI, Site.Operands);
+    return Site;
+  }
+
+  CondSite findBranchSite(Instruction &Term) {
+    CondSite Site;
+    Site.I = &Term;
+    if (DebugLoc DL = Term.getDebugLoc()) {
+      Site.LineNum = DL.getLine();
+    }
+
+    /*
+      Check the order of sucessors, because it may be reversed by LLVM.
+      e.g., `if(!x)`(x == 0 is True) is converted to `cmp ne i32 %x, 0`(False)
+      Reversed if will be like `br i1 %cmp, label %if.else, label %if.then`,
+      instead of `br i1 %cmp, label %if.then, label %if.else`.
+      */
+    if (auto *BrI = dyn_cast<BranchInst>(&Term)) {
+      auto *Cond = BrI->getCondition();
+      Site.LineNumStr = traceLines(Cond);
+      if (auto *CmpI = dyn_cast<ICmpInst>(Cond))
+        findCapturedOperands(*CmpI, Site.Operands);
+      Site.CondType = "if";
+      if (Term.getSuccessor(1)->getName().starts_with("if.then")) {
+        Site.CondType = "if-reverse";
+      }
+    } else {
+      Site.CondType = "switch";
+    }
+    return Site;
+  }
+
+  /*
+   * Capture the operands of the compare at runtime
+   * Returns "vals=<name>:<slot> ..." for the log
+   */
+  std::string
+  captureOperands(Instrumentation &Ins, ICmpInst &CmpI,
+                  ArrayRef<std::pair<Value *, std::string>> Operands) {
+    std::string Vals;
+    for (const auto &[Op, Name] : Operands) {
+      int Slot = Ins.insertValueCapture(CmpI, *Op, !CmpI.isUnsigned());
+      if (Slot < 0)
+        continue;
+
+      if (!Vals.empty())
+        Vals += " ";
+      Vals += Name + ":" + std::to_string(Slot);
     }
+    return Vals.empty() ? "" : "vals=" + Vals;
+  }
+
+  /*
+   * Record the index of the taken case at runtime
+   * Returns "case=<offset>/<width>;cases=<const> ..." for the log
+   */
+  std::string captureCase(Instrumentation &Ins, SwitchInst &SwI) {
+    int Offset = Ins.insertCaseCapture(SwI);
+    if (Offset < 0)
+      return "";
+
+    return "case=" + std::to_string(Offset) + "/" +
+           std::to_string(Instrumentation::getCaseWidth(SwI)) + ";" +
+           getCaseConsts(SwI);
+  }
+
+  // Returns "cases=<const> ..." in the order of the successors
+  std::string getCaseConsts(SwitchInst &SwI) {
+    std::string Info = "cases=";
+    for (auto Case : SwI.cases())
+      Info += std::to_string(Case.getCaseValue()->getSExtValue()) + " ";
+    if (Info.back() == ' ')
+      Info.pop_back();
+    return Info;
+  }
+
+  // Conditional branch or switch written in the source
+  bool shouldInstrument(Instruction &Term) {
+    if (Term.getNumSuccessors() <= 1)
+      return false;
+    if (!Term.getDebugLoc())
+      return false;
+    // Skip if the terminator is generated by the compiler
+    if (Term.getMetadata("nosanitize"))
+      return false;
+    // Only branches deciding whether the error is thrown are instrumented
+    if (!CondInfo->isDecisive(Term.getParent()))
+      return false;
+    return isa<BranchInst>(Term) || isa<SwitchInst>(Term);
+  }
+
+  // Conditions to be instrumented, which decide the width of the flags
+  unsigned countConditions(Function &F, bool Branches = true) {
+    unsigned NumConds = 0;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB)
+        if (auto *SelI = dyn_cast<SelectInst>(&I))
+          NumConds += shouldInstrument(*SelI);
+      if (Branches)
+        NumConds += shouldInstrument(*BB.getTerminator());
+    }
+    return NumConds;
+  }
+
+  // Select deciding the result, e.g., `return acl ? -EACCES : 0;`
+  bool shouldInstrument(SelectInst &SelI) {
+    if (!SelI.getDebugLoc() || SelI.getMetadata("nosanitize"))
+      return false;
+    if (!SelI.getCondition()->getType()->isIntegerTy(1))
+      return false;
+    return ConditionAnalysis::isDecisive(SelI);
+  }
+
+  // Trace the condition and return the line numbers, e.g., "27,26"
+  std::string traceLines(Value *Cond) {
+    std::string LineNumStr;
+    for (unsigned LineNum : traceValue(Cond))
+      LineNumStr += std::to_string(LineNum) + ",";
+    if (!LineNumStr.empty()) {
+      LineNumStr.pop_back(); // Remove the trailing comma
+    }
+    DEBUG_PRINT2("LineNum: " << LineNumStr << "\n");
+    return LineNumStr;
+  }
+
+  /*
+   * Find the next branch of a short-circuit chain
+   * `if (a && b)` is lowered to:
+      br i1 %a, label %land.lhs.true, label %if.end
+    land.lhs.true:
+      br i1 %b, label %if.then, label %if.end
+   * The next branch has the only predecessor in the chain, shares the exit
+   * with it, and belongs to the same condition of the source.
+   */
+  BranchInst *findNextInChain(BranchInst &BrI) {
+    for (unsigned i = 0; i < 2; i++) {
+      BasicBlock *Next = BrI.getSuccessor(i);
+      BasicBlock *Exit = BrI.getSuccessor(1 - i);
+      auto *NextBrI = dyn_cast<BranchInst>(Next->getTerminator());
+      if (!NextBrI || !shouldInstrument(*NextBrI))
+        continue;
+      if (Next->getSinglePredecessor() != BrI.getParent() || Next == Exit)
+        continue;
+      // Not a condition of the chain if either outcome goes the same way
+      if (NextBrI->getSuccessor(0) == NextBrI->getSuccessor(1))
+        continue;
+      if (NextBrI->getSuccessor(0) != Exit && NextBrI->getSuccessor(1) != Exit)
+        continue;
+      if (!Next->getName().starts_with("land.") &&
+          !Next->getName().starts_with("lor.") &&
+          NextBrI->getDebugLoc().getLine() != BrI.getDebugLoc().getLine())
+        continue;
+      return NextBrI;
+    }
+    return nullptr;
+  }
+
+  std::vector<std::vector<BranchInst *>> findChains(Function &F) {
+    DenseMap<BranchInst *, BranchInst *> NextOf;
+    SmallPtrSet<BranchInst *, 16> HasPrev;
+    for (BasicBlock &BB : F) {
+      auto *BrI = dyn_cast<BranchInst>(BB.getTerminator());
+      if (!BrI || !shouldInstrument(*BrI))
+        continue;
+      if (BranchInst *Next = findNextInChain(*BrI)) {
+        NextOf[BrI] = Next;
+        HasPrev.insert(Next);
+      }
+    }
+
+    std::vector<std::vector<BranchInst *>> Chains;
+    for (auto &Pair : NextOf) {
+      if (HasPrev.count(Pair.first))
+        continue;
+      std::vector<BranchInst *> Chain = {Pair.first};
+      SmallPtrSet<BranchInst *, 8> Visited = {Pair.first};
+      while (BranchInst *Next = NextOf.lookup(Chain.back())) {
+        if (!Visited.insert(Next).second)
+          break;
+        Chain.push_back(Next);
+      }
+      Chains.push_back(Chain);
+    }
+    return Chains;
+  }
+
+  /*
+   * Find the conditions whose outcomes tell the paths to the error apart
+   * Returns false if the paths are unknown, then all conditions are needed.
+   */
+  bool findNeededConds(Function &F,
+                       const SmallPtrSetImpl<BasicBlock *> &Throwers,
+                       std::vector<std::vector<BranchInst *>> &Chains,
+                       SmallPtrSetImpl<Instruction *> &Needed) {
+    std::vector<Instruction *> Conds;
+    DenseMap<Instruction *, long long> IDs;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB)
+        if (auto *SelI = dyn_cast<SelectInst>(&I))
+          if (shouldInstrument(*SelI)) {
+            IDs[SelI] = Conds.size();
+            Conds.push_back(SelI);
+          }
+      if (shouldInstrument(*BB.getTerminator())) {
+        IDs[BB.getTerminator()] = Conds.size();
+        Conds.push_back(BB.getTerminator());
+      }
+    }
+    if (Conds.size() > NUM_OF_FLAGS)
+      return false;
+
+    std::vector<ConditionAnalysis::ErrorPath> Paths;
+    if (!ConditionAnalysis::findErrorPaths(F, TRACKED_ERRNO, Throwers, IDs,
+                                           MAX_ERROR_PATHS, Paths))
+      return false;
+    uint64_t Chosen = ConditionAnalysis::findDistinguishingConds(Paths);
+    for (unsigned i = 0; i < Conds.size(); i++)
+      if ((Chosen >> i) & 1)
+        Needed.insert(Conds[i]);
+    DEBUG_PRINT2(F.getName() << ": " << Needed.size() << " of " << Conds.size()
+                             << " conditions tell " << Paths.size()
+                             << " reasons apart\n");
+
+    // A chain is updated at once, keep it whole or drop it
+    llvm::erase_if(Chains, [&](std::vector<BranchInst *> &Chain) {
+      return llvm::none_of(Chain,
+                           [&](BranchInst *BrI) { return Needed.count(BrI); });
+    });
+    for (auto &Chain : Chains)
+      Needed.insert(Chain.begin(), Chain.end());
+    return true;
   }
 
   bool
-  analyzeFunction(Function &F,
+  analyzeFunction(Function &F, FunctionAnalysisManager &FAM,
+                  InstrumentationContext &IC,
                   std::vector<macker::LogManager::LogEntry> &FunctionLogs) {
     // Extract debug info
     DebugInfo DBinfo;
@@ -105,6 +465,17 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
     if (!RetI)
       return false;
 
+    // Nothing to log if the function never returns the errno
+    CondInfo = &FAM.getResult<ConditionAnalysisPass>(F);
+    if (!CondInfo->mayReturnErrno()) {
+      DEBUG_PRINT2("Skip " << F.getName() << ": no error return\n");
+      return false;
+    }
+    const SmallPtrSetImpl<BasicBlock *> &Throwers = CondInfo->getThrowers();
+
+    TraceMemo.clear();
+    MSSA = &FAM.getResult<MemorySSAAnalysis>(F).getMSSA();
+
     ConditionAnalysis::getDebugInfo(DBinfo, *RetI, F);
 
 #if defined(KERNEL_MODE) && defined(DEBUG2)
@@ -118,81 +489,265 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
     }
 #endif
 
-    // Perform instrumentation
-    Instrumentation Ins(&F);
-    long long CondID = 0;
+#if defined(LOOP_MODE)
+    // Branches in loops overwrite their flags on each iteration
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    SmallPtrSet<BasicBlock *, 16> LoopBBs;
+    for (BasicBlock &BB : F)
+      if (LI.getLoopFor(&BB))
+        LoopBBs.insert(&BB);
+#endif
+
+#if defined(PATH_MODE)
+    // Branches are recorded by the path ID, unless the function has a loop
+    PathNumbering PN(F, &FAM.getResult<BlockFrequencyAnalysis>(F),
+                     &FAM.getResult<BranchProbabilityAnalysis>(F));
+    PathNumbering *Paths = PN.isValid() ? &PN : nullptr;
+#else
+    PathNumbering *Paths = nullptr;
+#endif
+
+    // Everything to instrument is found before the function is changed
+    unsigned NumConds = countConditions(F, !Paths);
+
+    // Branches of `&&`/`||` are updated at once when leaving the chain
+    std::vector<std::vector<BranchInst *>> Chains;
+    if (!Paths)
+      Chains = findChains(F);
+
+    // Conditions not telling the reasons apart are logged but not recorded
+    SmallPtrSet<Instruction *, 16> Needed;
+    bool Reduced = false;
+#if defined(REASON_MODE)
+    if (!Paths)
+      Reduced = findNeededConds(F, Throwers, Chains, Needed);
+#endif
 
+    // Outcomes implied by a dominating branch are left to the decoder
+    struct Implication {
+      BranchInst *By;
+      bool ByOutcome;
+      bool Outcome;
+    };
+    DenseMap<BranchInst *, Implication> Implied;
+    if (!Paths) {
+      DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      PostDominatorTree &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+      for (BasicBlock &BB : F) {
+        auto *BrI = dyn_cast<BranchInst>(BB.getTerminator());
+        if (!BrI || !shouldInstrument(*BrI))
+          continue;
+        Implication Imp;
+        Imp.By = ConditionAnalysis::findImplyingBranch(
+            *BrI, DT, PDT, Imp.ByOutcome, Imp.Outcome);
+        if (Imp.By)
+          Implied[BrI] = Imp;
+      }
+    }
+    DenseMap<BranchInst *, long long> ChainIDs;
+    for (auto &Chain : Chains)
+      for (BranchInst *BrI : Chain)
+        ChainIDs[BrI] = -1;
+
+    // Conditions to log, each in the row of its position
+    std::vector<CondSite> Sites;
+    DenseMap<Instruction *, long long> RowIDs; // Logged conditions
     for (BasicBlock &BB : F) {
+      // Selects are conditions without branch: `return acl ? -EACCES : 0;`
+      for (Instruction &I : BB)
+        if (auto *SelI = dyn_cast<SelectInst>(&I))
+          if (shouldInstrument(*SelI)) {
+            RowIDs[SelI] = Sites.size();
+            Sites.push_back(findSelectSite(*SelI));
+          }
+
       Instruction *Term = BB.getTerminator();
-      if (Term->getNumSuccessors() <= 1)
-        continue;
-      if (!Term->getDebugLoc())
-        continue;
-      // Skip if the terminator is generated by the compiler
-      if (Term->getMetadata("nosanitize"))
+      if (!shouldInstrument(*Term))
         continue;
+      RowIDs[Term] = Sites.size();
+      Sites.push_back(findBranchSite(*Term));
+      CondSite &Site = Sites.back();
+      // Block and successors to decode the path ID, if it is on any path
+      if (Paths && Paths->contains(&BB))
+        Site.PathInfo = "bb=" + Paths->getSuccInfo(*Term);
+#if defined(LOOP_MODE)
+      Site.InLoop = LoopBBs.count(&BB);
+#endif
+    }
 
-      // Init
-      LineNumQueue = std::queue<unsigned>();
-      LineNumSet.clear();
-
-      std::string CondType;
-
-      /*
-        Check the order of sucessors, because it may be reversed by LLVM.
-        e.g., `if(!x)`(x == 0 is True) is converted to `cmp ne i32 %x, 0`(False)
-        Reversed if will be like `br i1 %cmp, label %if.else, label %if.then`,
-        instead of `br i1 %cmp, label %if.then, label %if.else`.
-        */
-      if (auto *BrI = dyn_cast<BranchInst>(Term)) {
-        if (BrI->isConditional()) {
-          auto *Cond = BrI->getCondition();
-          traceValue(Cond);
-          CondType = "if";
-          if (Term->getSuccessor(1)->getName().starts_with("if.then")) {
-            CondType = "if-reverse";
-          }
+    // Catalog of the reasons, on the paths before any block is added
+    std::vector<ConditionAnalysis::ErrorPath> Reasons;
+    if (!ConditionAnalysis::findErrorPaths(F, TRACKED_ERRNO, Throwers, RowIDs,
+                                           MAX_ERROR_PATHS, Reasons)) {
+      DEBUG_PRINT2("No reason catalog for " << F.getName() << "\n");
+      Reasons.clear();
+    }
+    DenseMap<BasicBlock *, unsigned> ThrowerLines;
+    for (BasicBlock *Thrower : Throwers)
+      for (Instruction &I : *Thrower)
+        if (DebugLoc DL = I.getDebugLoc()) {
+          ThrowerLines[Thrower] = DL.getLine();
+          break;
         }
-      } else if (auto *SI = dyn_cast<SwitchInst>(Term)) {
-        CondType = "switch";
-      } else {
-        continue;
-      }
 
-      unsigned LineNum = 0;
-      if (DebugLoc DL = Term->getDebugLoc()) {
-        LineNum = DL.getLine();
-      }
+    // Capture the target of indirect calls (e.g., LSM hooks) deciding result
+    std::vector<CallInst *> IndirectCalls;
+    for (Instruction &I : instructions(F)) {
+      auto *CallI = dyn_cast<CallInst>(&I);
+      if (CallI && CallI->isIndirectCall() &&
+          ConditionAnalysis::isDecisive(*CallI))
+        IndirectCalls.push_back(CallI);
+    }
 
-      // Print the condition
-      std::string LineNumStr;
-      while (!LineNumQueue.empty()) {
-        unsigned LineNum = LineNumQueue.front();
-        LineNumQueue.pop();
-        LineNumStr += std::to_string(LineNum) + ",";
+    /*
+     * Perform instrumentation
+     * The analyses above are of the function before it is changed, so nothing
+     * is asked of them from here on.
+     */
+    Instrumentation Ins(&F, IC, NumConds);
+    DenseMap<Instruction *, long long> CondIDs; // Recorded conditions
+    for (CondSite &Site : Sites) {
+      long long CondID = RowIDs[Site.I];
+      std::string ExtraInfo;
+
+      if (auto *SelI = dyn_cast<SelectInst>(Site.I)) {
+        bool IsSkipped = Reduced && !Needed.count(SelI);
+        if (auto *CmpI = dyn_cast<ICmpInst>(SelI->getCondition());
+            CmpI && !IsSkipped)
+          ExtraInfo = captureOperands(Ins, *CmpI, Site.Operands);
+
+        LogManager::getInstance().addEntry(DBinfo.first,
+                                           Site.LineNum,
+                                           DBinfo.second,
+                                           Site.CondType,
+                                           CondID,
+                                           Site.LineNumStr,
+                                           ExtraInfo);
+        // The row is logged, so its ID is taken even if not recorded
+        if (!IsSkipped && Ins.insertSelectUpdate(*SelI, CondID))
+          CondIDs[SelI] = CondID;
+        continue;
       }
-      if (!LineNumStr.empty()) {
-        LineNumStr.pop_back(); // Remove the trailing comma
+
+      Instruction *Term = Site.I;
+      auto *BrI = dyn_cast<BranchInst>(Term);
+      auto *SwI = dyn_cast<SwitchInst>(Term);
+      auto *CmpI = BrI ? dyn_cast<ICmpInst>(BrI->getCondition()) : nullptr;
+
+      // The implying branch must be recorded before, and the conditions
+      // chosen to tell the reasons apart are recorded anyway
+      auto ImpIt = BrI ? Implied.find(BrI) : Implied.end();
+      bool IsImplied = ImpIt != Implied.end() && !ChainIDs.count(BrI) &&
+                       !Needed.count(BrI) && CondIDs.count(ImpIt->second.By);
+      bool IsSkipped =
+          Reduced && !Needed.count(Term) && !(BrI && ChainIDs.count(BrI));
+
+      // Store the compared values for the log
+      if (IsImplied)
+        ExtraInfo = "implied=" +
+                    std::to_string(CondIDs[ImpIt->second.By]) + ":" +
+                    std::to_string(ImpIt->second.ByOutcome) + ":" +
+                    std::to_string(ImpIt->second.Outcome);
+      else if (CmpI && !IsSkipped)
+        ExtraInfo = captureOperands(Ins, *CmpI, Site.Operands);
+      else if (SwI && !Paths && !IsSkipped)
+        ExtraInfo = captureCase(Ins, *SwI);
+      else if (SwI)
+        ExtraInfo = getCaseConsts(*SwI);
+      if (!Site.PathInfo.empty())
+        ExtraInfo += (ExtraInfo.empty() ? "" : ";") + Site.PathInfo;
+#if defined(LOOP_MODE)
+      if (BrI && Site.InLoop && !IsImplied && !IsSkipped) {
+        int Slot = Ins.insertHistoryUpdate(*BrI);
+        if (Slot >= 0)
+          ExtraInfo += (ExtraInfo.empty() ? "hist=" : ";hist=") +
+                       std::to_string(Slot);
       }
-      DEBUG_PRINT2("LineNum: " << LineNumStr << "\n");
+#endif
 
       LogManager::getInstance().addEntry(DBinfo.first,
-                                         LineNum,
+                                         Site.LineNum,
                                          DBinfo.second,
-                                         CondType,
+                                         Site.CondType,
                                          CondID,
-                                         LineNumStr,
-                                         "");
+                                         Site.LineNumStr,
+                                         ExtraInfo);
 
       // Add instrumentation
-      if (Ins.insertBufferFunc(BB, DBinfo, CondID)) {
-        CondID++;
-        DEBUG_PRINT2("Inserted at " << BB.getName() << "\n");
-        DEBUG_PRINT2(BB << "\n");
+      if (Paths) {
+        CondIDs[Term] = CondID;
+      } else if (IsImplied || IsSkipped) {
+        continue;
+      } else if (BrI && ChainIDs.count(BrI)) {
+        // Recorded once the update of the chain is inserted
+        ChainIDs[BrI] = CondID;
+      } else if (Ins.insertBufferFunc(*Term->getParent(), DBinfo, CondID)) {
+        CondIDs[Term] = CondID;
+        DEBUG_PRINT2("Inserted at " << Term->getParent()->getName() << "\n");
+        DEBUG_PRINT2(*Term->getParent() << "\n");
       }
     }
 
-    return Ins.insertFlushFunc(DBinfo, *RetI->getParent());
+    if (Paths)
+      Ins.insertPathIncrements(*Paths);
+
+    for (auto &Chain : Chains) {
+      std::vector<long long> IDs;
+      for (BranchInst *BrI : Chain)
+        IDs.push_back(ChainIDs[BrI]);
+      if (Ins.insertChainUpdate(Chain, IDs))
+        for (BranchInst *BrI : Chain)
+          CondIDs[BrI] = ChainIDs[BrI];
+    }
+
+    // Conditions the runtime records, the key to look up the reason
+    uint64_t Recorded = 0;
+    for (auto &Pair : CondIDs)
+      if (Pair.second < 64)
+        Recorded |= 1ULL << Pair.second;
+
+    ConditionAnalysis::mergeErrorPaths(Reasons, Recorded);
+    for (unsigned i = 0; i < Reasons.size(); i++) {
+      unsigned Line = ThrowerLines.lookup(Reasons[i].Thrower);
+      std::string ExtraInfo = "mask=" + utohexstr(Reasons[i].Mask) +
+                              ";dst=" + utohexstr(Reasons[i].Dst);
+      if (Reasons[i].NumPaths > 1)
+        ExtraInfo += ";paths=" + std::to_string(Reasons[i].NumPaths);
+      LogManager::getInstance().addEntry(DBinfo.first, Line, DBinfo.second,
+                                         "reason", i, "", ExtraInfo);
+    }
+
+    for (CallInst *CallI : IndirectCalls)
+      Ins.insertCalleeCapture(*CallI);
+
+    bool Flushed = Ins.insertFlushFunc(DBinfo, *RetI->getParent());
+#if defined(SSA_MODE)
+    if (Flushed)
+      Ins.promoteFlags();
+#endif
+
+    // The runtime only knows the FuncID, keep a row even without conditions
+    unsigned RetLine = 0;
+    if (DebugLoc DL = RetI->getDebugLoc())
+      RetLine = DL.getLine();
+    std::string ExtraInfo = "stack=" + std::to_string(Ins.getStackSize());
+    if (Paths)
+      ExtraInfo += ";dag=" + Paths->str();
+    if (!Reasons.empty())
+      ExtraInfo += ";rec=" + utohexstr(Recorded);
+    LogManager::getInstance().addEntry(DBinfo.first,
+                                       RetLine,
+                                       DBinfo.second,
+                                       "return",
+                                       Sites.size(),
+                                       "",
+                                       ExtraInfo);
+
+    // The flags are added even without the flush, so the function changed
+    if (!Flushed)
+      DEBUG_PRINT2("No flush in " << F.getName() << "\n");
+    FAM.invalidate(F, PreservedAnalyses::none());
+    return true;
   }
 
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
@@ -205,9 +760,15 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
     parser.parse();
     const auto &logs = parser.getParsedLogs();
 
+    FunctionAnalysisManager &FAM =
+        AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    InstrumentationContext IC(M);
+    // Computed before the functions, so their conditions can use it
+    const ErrnoSummary &Summary = AM.getResult<ErrnoSummaryAnalysis>(M);
+
     bool Modified = false;
     for (auto &F : M.functions()) {
-      if (shouldProcessFunction(F)) {
+      if (shouldProcessFunction(F) && Summary.mayReturnErrno(F)) {
         // Filter logs for the current function
         std::vector<macker::LogManager::LogEntry> FunctionLogs;
         for (const auto &log : logs) {
@@ -217,10 +778,13 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
         }
 
         // Process the function with its logs
-        Modified |= analyzeFunction(F, FunctionLogs);
+        Modified |= analyzeFunction(F, FAM, IC, FunctionLogs);
       }
     }
 
+    // Modules compiled later look up the functions of this one
+    Summary.store(M);
+
     DEBUG_PRINT2("Permod: Finished analyzing functions.\n");
     DEBUG_PRINT2("Permod: Writing logs to CSV file...\n");
     DEBUG_PRINT2("Permod: File: " << M.getName() << "\n");
@@ -245,7 +809,7 @@ struct PermodPass : public PassInfoMixin<PermodPass> {
            !F.getName().startswith("llvm") &&
            F.getName() != LOGGR_FUNC && 
            F.getName() != BUFFR_FUNC &&
-           F.getName() != FLUSH_FUNC;
+           F.getName() != FLUSH_VAL_FUNC;
     // clang-format on
   }
 
@@ -266,6 +830,16 @@ llvmGetPassPluginInfo() {
           .PluginName = "Permod pass",
           .PluginVersion = "v0.1",
           .RegisterPassBuilderCallbacks = [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](FunctionAnalysisManager &FAM) {
+                  FAM.registerPass(
+                      [] { return ConditionAnalysisPass(TRACKED_ERRNO); });
+                });
+            PB.registerAnalysisRegistrationCallback(
+                [](ModuleAnalysisManager &MAM) {
+                  MAM.registerPass(
+                      [] { return ErrnoSummaryAnalysis(TRACKED_ERRNO); });
+                });
             PB.registerPipelineStartEPCallback(
                 [](ModulePassManager &MPM, OptimizationLevel Level) {
                   MPM.addPass(PermodPass());
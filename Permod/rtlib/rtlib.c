@@ -1,40 +1,243 @@
 #if !defined(USER_MODE)
+#include <asm/sections.h>
 #include <linux/printk.h>
 #define LogFunc(_fmt, ...) pr_debug(_fmt, ##__VA_ARGS__)
+#define TEXT_BASE ((unsigned long)_text)
 #else // USER_MODE
 #include <stdio.h>
 #define LogFunc(_fmt, ...) fprintf(stderr, _fmt, ##__VA_ARGS__)
+extern char __executable_start[];
+#define TEXT_BASE ((unsigned long)__executable_start)
 #endif
 
+#define NUM_OF_FLAGS 64
+
+/*
+ * Record encoding
+ * A record is a sequence of fields, each starting with a tag byte.
+ * - DENSE:  varint(nbytes), ext[nbytes], dst[nbytes] (little endian)
+ * - SPARSE: varint(count), count * varint((delta << 1) | outcome)
+ *           delta is the distance from the previous condition index.
+ * - RETADDR: varint(offset of the caller's return address from TEXT_BASE)
+ * - CALLEE: varint(offset of the indirect callee that failed from TEXT_BASE)
+ * - VALUES: varint(count), count * zigzag varint(value of compared operand)
+ * - CASES:  varint(nbytes), nbytes * (taken case index of switches)
+ * - HISTORY: varint(count), count * (varint(iterations), varint(outcomes))
+ *            outcomes has the last 32 outcomes of a branch in a loop, LSB last.
+ * - PATH:   varint(Ball-Larus path ID of the function)
+ * The flags are encoded in whichever form is smaller.
+ * The record is printed as a hex string, decoded by scripts/monitor.py.
+ * The function is identified by its FuncID in permod_logs.csv.
+ */
+#define RECORD_MAX 96
+#define REC_DENSE 0x01
+#define REC_SPARSE 0x02
+#define REC_RETADDR 0x03
+#define REC_CALLEE 0x04
+#define REC_VALUES 0x05
+#define REC_CASES 0x06
+#define REC_HISTORY 0x07
+#define REC_PATH 0x08
+
+struct record {
+  unsigned char buf[RECORD_MAX];
+  unsigned int len;
+  int truncated;
+};
+
+static void rec_put(struct record *rec, unsigned char byte) {
+  if (rec->len >= RECORD_MAX) {
+    rec->truncated = 1;
+    return;
+  }
+  rec->buf[rec->len++] = byte;
+}
+
+static unsigned int varint_len(unsigned long long val) {
+  unsigned int len = 1;
+  while (val >= 0x80) {
+    val >>= 7;
+    len++;
+  }
+  return len;
+}
+
+static void rec_put_varint(struct record *rec, unsigned long long val) {
+  while (val >= 0x80) {
+    rec_put(rec, (unsigned char)(val | 0x80));
+    val >>= 7;
+  }
+  rec_put(rec, (unsigned char)val);
+}
+
+static unsigned char flag_byte(const unsigned long long *flags,
+                               unsigned int nth) {
+  return (unsigned char)(flags[nth / 8] >> ((nth % 8) * 8));
+}
+
+/* Encode @nwords words of ext/dst flags as dense bitmap or sparse list */
+static void rec_put_flags(struct record *rec, const unsigned long long *ext,
+                          const unsigned long long *dst, unsigned int nwords) {
+  unsigned int nbytes = 0, count = 0, sparse_len = 0, dense_len;
+  unsigned int i, prev = 0;
+
+  for (i = 0; i < nwords * NUM_OF_FLAGS; i++) {
+    unsigned long long bit = 1ULL << (i % NUM_OF_FLAGS);
+    if (!(ext[i / NUM_OF_FLAGS] & bit))
+      continue;
+    sparse_len += varint_len((unsigned long long)(i - prev) << 1 | 1);
+    prev = i;
+    count++;
+    nbytes = i / 8 + 1;
+  }
+  sparse_len += 1 + varint_len(count);
+  dense_len = 1 + varint_len(nbytes) + 2 * nbytes;
+
+  if (dense_len <= sparse_len) {
+    rec_put(rec, REC_DENSE);
+    rec_put_varint(rec, nbytes);
+    for (i = 0; i < nbytes; i++)
+      rec_put(rec, flag_byte(ext, i));
+    for (i = 0; i < nbytes; i++)
+      rec_put(rec, flag_byte(dst, i) & flag_byte(ext, i));
+    return;
+  }
+
+  rec_put(rec, REC_SPARSE);
+  rec_put_varint(rec, count);
+  prev = 0;
+  for (i = 0; i < nwords * NUM_OF_FLAGS; i++) {
+    unsigned long long bit = 1ULL << (i % NUM_OF_FLAGS);
+    if (!(ext[i / NUM_OF_FLAGS] & bit))
+      continue;
+    rec_put_varint(rec,
+                   (unsigned long long)(i - prev) << 1 |
+                       !!(dst[i / NUM_OF_FLAGS] & bit));
+    prev = i;
+  }
+}
+
+/* Code addresses are recorded relative to the text base to survive KASLR/PIE */
+static void rec_put_addr(struct record *rec, unsigned char tag, void *addr) {
+  if (!addr)
+    return;
+  rec_put(rec, tag);
+  rec_put_varint(rec, (unsigned long)addr - TEXT_BASE);
+}
+
+static void rec_put_values(struct record *rec, const long long *val_list,
+                           int nvals) {
+  int i;
+
+  if (!val_list || nvals <= 0)
+    return;
+  rec_put(rec, REC_VALUES);
+  rec_put_varint(rec, nvals);
+  for (i = 0; i < nvals; i++) {
+    unsigned long long val = (unsigned long long)val_list[i];
+    rec_put_varint(rec, (val << 1) ^ (val_list[i] < 0 ? ~0ULL : 0));
+  }
+}
+
+static void rec_put_bytes(struct record *rec, unsigned char tag,
+                          const unsigned char *bytes, int nbytes) {
+  int i;
+
+  if (!bytes || nbytes <= 0)
+    return;
+  rec_put(rec, tag);
+  rec_put_varint(rec, nbytes);
+  for (i = 0; i < nbytes; i++)
+    rec_put(rec, bytes[i]);
+}
+
+static void rec_put_history(struct record *rec,
+                            const unsigned long long *hist_list, int nhist) {
+  int i;
+
+  if (!hist_list || nhist <= 0)
+    return;
+  rec_put(rec, REC_HISTORY);
+  rec_put_varint(rec, nhist);
+  for (i = 0; i < nhist; i++) {
+    rec_put_varint(rec, hist_list[i] >> 32);
+    rec_put_varint(rec, hist_list[i] & 0xffffffffULL);
+  }
+}
+
+static void rec_emit(struct record *rec, unsigned int funcid, int retval) {
+  static const char hex[] = "0123456789abcdef";
+  char str[RECORD_MAX * 2 + 1];
+  unsigned int i;
+
+  for (i = 0; i < rec->len; i++) {
+    str[i * 2] = hex[rec->buf[i] >> 4];
+    str[i * 2 + 1] = hex[rec->buf[i] & 0xf];
+  }
+  str[rec->len * 2] = '\0';
+
+  LogFunc("[Permod],%08x,%d,%s%s\n",
+          funcid,
+          retval,
+          str,
+          rec->truncated ? "+" : "");
+}
+
 void buffer_cond(long long *ext_list, long long *dst_list, long long nth,
                  long long dest) {
 #if defined(DEBUG)
   LogFunc("buffer_cond(%lld, %lld)\n", nth, dest);
 #endif
-  *ext_list |= (1 << nth);
+  if (nth < 0 || nth >= NUM_OF_FLAGS)
+    return;
+  *ext_list |= (1ULL << nth);
   if (dest) {
-    *dst_list |= (1 << nth);
+    *dst_list |= (1ULL << nth);
   } else {
-    *dst_list &= ~(1 << nth);
+    *dst_list &= ~(1ULL << nth);
   }
 }
 #if !defined(USER_MODE)
 EXPORT_SYMBOL(buffer_cond);
 #endif
 
-void flush_cond(long long *ext_list, long long *dst_list, const char *pathname,
-                const char *funcname, int retval) {
-  if (retval == -13) {
-    LogFunc("[Permod],%s,%s,%d,0x%llx,0x%llx\n",
-            pathname,
-            funcname,
-            retval,
-            *ext_list,
-            *dst_list);
+static void flush_record(unsigned long long ext, unsigned long long dst,
+                         unsigned int funcid, int retval, void *retaddr,
+                         void *callee, long long *val_list, int nvals,
+                         unsigned char *case_list, int ncases,
+                         unsigned long long *hist_list, int nhist,
+                         long long path_id) {
+  struct record rec = {.len = 0};
+
+  rec_put_flags(&rec, &ext, &dst, 1);
+  rec_put_addr(&rec, REC_RETADDR, retaddr);
+  rec_put_addr(&rec, REC_CALLEE, callee);
+  rec_put_values(&rec, val_list, nvals);
+  rec_put_bytes(&rec, REC_CASES, case_list, ncases);
+  rec_put_history(&rec, hist_list, nhist);
+  if (path_id >= 0) {
+    rec_put(&rec, REC_PATH);
+    rec_put_varint(&rec, path_id);
   }
-  *ext_list = 0;
-  *dst_list = 0;
+  rec_emit(&rec, funcid, retval);
+}
+
+/*
+ * Flags are passed by value, so they can live in registers of the caller
+ * Only called on the error path, see Instrumentation::insertFlushFunc()
+ */
+__attribute__((__cold__))
+void flush_cond_val(unsigned long long ext, unsigned long long dst,
+                    unsigned int funcid, int retval, void *retaddr,
+                    void *callee, long long *val_list, int nvals,
+                    unsigned char *case_list, int ncases,
+                    unsigned long long *hist_list, int nhist,
+                    long long path_id) {
+  if (retval == -13)
+    flush_record(ext, dst, funcid, retval, retaddr, callee,
+                 val_list, nvals, case_list, ncases, hist_list, nhist,
+                 path_id);
 }
 #if !defined(USER_MODE)
-EXPORT_SYMBOL(flush_cond);
+EXPORT_SYMBOL(flush_cond_val);
 #endif
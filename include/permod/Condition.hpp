@@ -82,6 +82,5 @@ public:
       : Name(name), Con(con), Type(type), Flag(flag) {}
 };
 
-typedef std::vector<Condition *> CondStack;
 typedef std::pair<StringRef, StringRef> DebugInfo; // <filename, funcname>
 } // namespace permod
@@ -6,8 +6,15 @@
 #pragma once
 
 #include "permod/Condition.hpp"
+#include "permod/StoreIndex.hpp"
 #include "utils/macro.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassManager.h"
+
+#include <vector>
 
 #if defined(DEBUG)
 extern const char *condTypeStr[];
@@ -15,30 +22,90 @@ extern const char *condTypeStr[];
 
 using namespace llvm;
 
+namespace llvm {
+class DominatorTree;
+class PostDominatorTree;
+} // namespace llvm
+
 namespace permod {
 namespace ConditionAnalysis {
+// Origin of a value, by the value and the block asking for it
+using OriginCache = DenseMap<std::pair<Value *, BasicBlock *>, Value *>;
+
+// Outcomes of the recorded conditions on a path to an error return
+struct ErrorPath {
+  BasicBlock *Thrower;   // First error-thrower on the path
+  uint64_t Mask;         // Conditions on the path
+  uint64_t Dst;          // Conditions taking the first successor
+  unsigned NumPaths = 1; // Paths merged into this one
+};
+
 // ****************************************************************************
 //                               Utility
 // ****************************************************************************
-Value *getLatestValue(AllocaInst &AI, BasicBlock &TheBB);
-Value *getOrigin(Value &V);
+Value *getLatestValue(AllocaInst &AI, BasicBlock &TheBB,
+                      const StoreIndex *Stores = nullptr);
+Value *getOrigin(Value &V, const StoreIndex *Stores = nullptr,
+                 OriginCache *Cache = nullptr);
 StringRef getStructName(GetElementPtrInst &GEPI);
-StringRef getVarName(Value &V);
+StringRef getVarName(Value &V, const StoreIndex *Stores = nullptr,
+                     OriginCache *Cache = nullptr);
+bool isDecisive(Value &V);
+void findErrorThrowers(Function &F, int64_t Errno,
+                       SmallPtrSetImpl<BasicBlock *> &Throwers,
+                       function_ref<bool(CallBase &)> MayReturnErrno = nullptr);
+void findDecisiveBranches(PostDominatorTree &PDT,
+                          const SmallPtrSetImpl<BasicBlock *> &Throwers,
+                          SmallPtrSetImpl<BasicBlock *> &Decisive);
+BranchInst *findImplyingBranch(BranchInst &BrI, DominatorTree &DT,
+                               PostDominatorTree &PDT, bool &DomOutcome,
+                               bool &Outcome);
+bool findErrorPaths(Function &F, int64_t Errno,
+                    const SmallPtrSetImpl<BasicBlock *> &Throwers,
+                    const DenseMap<Instruction *, long long> &CondIDs,
+                    unsigned MaxPaths, std::vector<ErrorPath> &Paths);
+void mergeErrorPaths(std::vector<ErrorPath> &Paths, uint64_t Recorded);
+uint64_t findDistinguishingConds(const std::vector<ErrorPath> &Paths);
+void getDebugInfo(DebugInfo &DBinfo, Instruction &I, Function &F);
+} // namespace ConditionAnalysis
 
 /*
  * ****************************************************************************
- *                       Anlyzing Conditions
+ *                       Result of the analysis
  * ****************************************************************************
  */
-bool findIfCond_cmp(CondStack &Conds, BranchInst &BrI, CmpInst &CmpI,
-                    BasicBlock &DestBB);
-bool findIfCond_call(CondStack &Conds, BranchInst &BrI, CallInst &CallI,
-                     BasicBlock &DestBB);
-bool findIfCond(CondStack &Conds, BranchInst &BrI, BasicBlock &DestBB);
-bool findSwCond(CondStack &Conds, SwitchInst &SwI);
-bool findConditions(CondStack &Conds, BasicBlock &CondBB, BasicBlock &DestBB);
-
-void setRetCond(CondStack &Conds, BasicBlock &theBB);
-void getDebugInfo(DebugInfo &DBinfo, Instruction &I, Function &F);
-} // namespace ConditionAnalysis
+class ConditionInfo {
+public:
+  const SmallPtrSetImpl<BasicBlock *> &getThrowers() const { return Throwers; }
+  bool mayReturnErrno() const { return !Throwers.empty(); }
+  /* Whether the branch of the block decides if an error is thrown */
+  bool isDecisive(const BasicBlock *BB) const { return Decisive.count(BB); }
+  /* Origin and name of the value, cached for the function */
+  Value *getOrigin(Value &V) const;
+  StringRef getVarName(Value &V) const;
+
+private:
+  friend class ConditionAnalysisPass;
+  SmallPtrSet<BasicBlock *, 8> Throwers;
+  SmallPtrSet<const BasicBlock *, 32> Decisive;
+  StoreIndex Stores; // Of the function before it is instrumented
+  mutable ConditionAnalysis::OriginCache Origins;
+};
+
+/*
+ * Error-throwers and decisive branches of a function
+ * Cached by the FunctionAnalysisManager until the function is changed.
+ */
+class ConditionAnalysisPass : public AnalysisInfoMixin<ConditionAnalysisPass> {
+public:
+  using Result = ConditionInfo;
+
+  explicit ConditionAnalysisPass(int64_t Errno) : Errno(Errno) {}
+  Result run(Function &F, FunctionAnalysisManager &FAM);
+
+private:
+  friend AnalysisInfoMixin<ConditionAnalysisPass>;
+  static AnalysisKey Key;
+  int64_t Errno;
+};
 } // namespace permod
@@ -0,0 +1,63 @@
+//===- permod/ErrnoSummary.h - Functions returning the errno ------*-C++-*-===//
+//
+// Summarize for each function whether it may return the errno, either as a
+// constant or by passing on the result of a callee. The call graph is walked
+// bottom-up, and callees defined in other modules are looked up in the
+// summaries persisted when those modules were compiled.
+//
+
+#pragma once
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+#include <string>
+
+using namespace llvm;
+
+namespace permod {
+
+class ErrnoSummary {
+public:
+  /* False only if the function provably never returns the errno */
+  bool mayReturnErrno(const Function &F) const;
+  bool mayReturnErrno(const CallBase &CB) const;
+
+  /* Write the functions of the module to the summary file */
+  void store(Module &M) const;
+
+  /*
+   * Instrumentation doesn't change what the functions return, and the
+   * functions are known by name, so none is left dangling when deleted
+   */
+  bool invalidate(Module &, const PreservedAnalyses &,
+                  ModuleAnalysisManager::Invalidator &) {
+    return false;
+  }
+
+private:
+  friend class ErrnoSummaryAnalysis;
+  StringMap<bool> Local;    // Functions of the module
+  StringMap<bool> External; // From the summary file
+  std::string File;         // "<function>,<0|1>" per line
+};
+
+class ErrnoSummaryAnalysis : public AnalysisInfoMixin<ErrnoSummaryAnalysis> {
+public:
+  using Result = ErrnoSummary;
+
+  explicit ErrnoSummaryAnalysis(int64_t Errno,
+                                std::string File = "permod_summary.txt")
+      : Errno(Errno), File(std::move(File)) {}
+  Result run(Module &M, ModuleAnalysisManager &);
+
+private:
+  friend AnalysisInfoMixin<ErrnoSummaryAnalysis>;
+  static AnalysisKey Key;
+  int64_t Errno;
+  std::string File;
+};
+
+} // namespace permod
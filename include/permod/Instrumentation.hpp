@@ -1,9 +1,11 @@
 
 #pragma once
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/IRBuilder.h"
 
 #include "permod/Condition.hpp"
+#include "permod/PathNumbering.hpp"
 #include "utils/macro.h"
 
 #if defined(DEBUG)
@@ -17,19 +19,79 @@ extern const char *condTypeStr[];
 #endif
 
 #define BUFFR_FUNC "buffer_cond"
-#define FLUSH_FUNC "flush_cond"
+#define FLUSH_VAL_FUNC "flush_cond_val"
+
+/* Conditions recorded per frame at most */
+#define NUM_OF_FLAGS 64
+
+/* Errno to log when returned (EACCES) */
+#define TRACKED_ERRNO 13
+
+/* Slots for the values of compared operands per frame */
+#define NUM_OF_VALUES 8
+/* Bytes for the taken case index of switches per frame */
+#define NUM_OF_CASE_BYTES 16
+/* Outcome histories of branches in loops per frame (LOOP_MODE) */
+#define NUM_OF_HISTORIES 4
 
 using namespace llvm;
 using namespace permod;
 
+/*
+ * Per-module state shared by the instrumentation of every function
+ * Runtime functions are declared once, strings are interned.
+ */
+class InstrumentationContext {
+  Module &M;
+  LLVMContext &Ctx;
+
+  /* Runtime functions, declared on first use */
+  FunctionCallee BufferFunc;
+  FunctionCallee FlushFunc;
+  Function *RetAddrFunc = nullptr;
+
+  /* String globals */
+  StringMap<Constant *> Strings;
+
+public:
+  InstrumentationContext(Module &M) : M(M), Ctx(M.getContext()) {}
+
+  FunctionCallee getBufferFunc();
+  FunctionCallee getFlushFunc();
+  Function *getRetAddrFunc();
+  Constant *getString(StringRef Str);
+};
+
 class Instrumentation {
   /* Analysis Target */
   Function *TargetFunc;
 
+  /* Module-level declarations */
+  InstrumentationContext &IC;
+
   /* Flags */
+  IntegerType *FlagTy;
   AllocaInst *DstFlag;
   AllocaInst *ExtFlag;
 
+  /* Target of the last failed indirect call */
+  AllocaInst *CalleeSlot = nullptr;
+
+  /* Values of compared operands */
+  AllocaInst *ValList = nullptr;
+  unsigned NumValues = 0;
+
+  /* Taken case index of switches (0 is default) */
+  AllocaInst *CaseList = nullptr;
+  unsigned NumCaseBytes = 0;
+
+  /* Outcome histories: iteration count (high 32) | last outcomes (low 32) */
+  AllocaInst *HistList = nullptr;
+  unsigned NumHistories = 0;
+
+  /* Ball-Larus path ID (PATH_MODE) */
+  AllocaInst *PathReg = nullptr;
+
   /* IRBuilder */
   LLVMContext &Ctx;
   IRBuilder<> Builder;
@@ -40,18 +102,45 @@ class Instrumentation {
 
   /* Constructor methods */
   void prepFormat();
-  void prepFlags();
+  void prepFlags(unsigned NumConds);
+  void prepCalleeSlot();
+  void prepValList();
+  void prepCaseList();
+  void prepHistList();
+  void prepPathReg();
+
+  /* Flag update at the insert point of Builder */
+  void updateFlags(Value *Mask, Value *Bits);
 
 public:
   /* Constructor */
-  Instrumentation(Function *TargetFunc)
-      : TargetFunc(TargetFunc), Ctx(TargetFunc->getContext()),
+  Instrumentation(Function *TargetFunc, InstrumentationContext &IC,
+                  unsigned NumConds = NUM_OF_FLAGS)
+      : TargetFunc(TargetFunc), IC(IC), Ctx(TargetFunc->getContext()),
         Builder(TargetFunc->getContext()) {
-    prepFlags();
+    prepFlags(NumConds);
   }
 
+  /* Conditions the flags can hold */
+  unsigned getNumFlags() { return FlagTy->getBitWidth(); }
+  unsigned getStackSize();
+
   /* Instrumentation */
   bool insertBufferFunc(BasicBlock &TheBB, DebugInfo &DBinfo,
                         long long &cond_num);
+  bool insertCalleeCapture(CallInst &CallI);
+  int insertValueCapture(Instruction &Before, Value &V, bool isSigned);
+  int insertCaseCapture(SwitchInst &SwI);
+  int insertHistoryUpdate(BranchInst &BrI);
+  bool insertSelectUpdate(SelectInst &SelI, long long cond_num);
+  bool insertChainUpdate(ArrayRef<BranchInst *> Chain,
+                         ArrayRef<long long> IDs);
+  bool insertPathIncrements(const PathNumbering &PN);
+
+  /* Bytes to hold the case index of the switch */
+  static unsigned getCaseWidth(SwitchInst &SwI) {
+    return SwI.getNumCases() < UINT8_MAX ? 1 : 2;
+  }
   bool insertFlushFunc(DebugInfo &DBinfo, BasicBlock &TheBB);
+  bool promoteFlags();
 };
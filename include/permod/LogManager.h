@@ -37,10 +37,14 @@ public:
     unsigned CondID;
     std::string Content;
     std::string ExtraInfo;
+    uint32_t FuncID;
   };
 
   static LogManager &getInstance();
 
+  // Stable ID of a function passed to the runtime instead of its names
+  static uint32_t getFuncID(StringRef FileName, StringRef FuncName);
+
   void addEntry(StringRef FileName, unsigned LineNumber, StringRef FuncName,
                 StringRef EventType, unsigned CondID, StringRef Content,
                 StringRef ExtraInfo);
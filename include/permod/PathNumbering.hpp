@@ -0,0 +1,58 @@
+//===- permod/PathNumbering.h - Ball-Larus path numbering ---------*-C++-*-===//
+//
+// Number the paths from the entry to the exits of an acyclic function, so that
+// the sum of the values of the taken edges is a unique ID of the path.
+// Only the edges out of a maximum spanning tree need to update the path ID.
+//
+
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/IR/Function.h"
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace permod {
+
+class PathNumbering {
+public:
+  struct Edge {
+    BasicBlock *Src;
+    BasicBlock *Dst; // nullptr for the edge from an exit to the virtual exit
+    uint64_t Val;    // Value of the edge in the path ID
+    int64_t Inc;     // Increment placed on the edge, 0 for the tree edges
+  };
+
+  PathNumbering(Function &F, BlockFrequencyInfo *BFI = nullptr,
+                BranchProbabilityInfo *BPI = nullptr);
+
+  /* False if the function has a loop or too many paths */
+  bool isValid() const { return Valid; }
+
+  uint64_t getNumPaths() const { return NumPaths.lookup(Blocks.front()); }
+  unsigned getIndex(BasicBlock *BB) const { return Index.lookup(BB); }
+  /* False for the blocks unreachable from the entry, which are not numbered */
+  bool contains(BasicBlock *BB) const { return Index.count(BB); }
+  const std::vector<Edge> &edges() const { return Edges; }
+
+  /* "<idx>><succ idx>,..." of a numbered block, successors in operand order */
+  std::string getSuccInfo(Instruction &Term) const;
+  /* "<idx>><succ idx>@<val>,... ..." for the decoder */
+  std::string str() const;
+
+private:
+  void placeIncrements(BlockFrequencyInfo *BFI, BranchProbabilityInfo *BPI);
+
+  std::vector<BasicBlock *> Blocks; // Reverse post order
+  DenseMap<BasicBlock *, unsigned> Index;
+  DenseMap<BasicBlock *, uint64_t> NumPaths;
+  std::vector<Edge> Edges;
+  bool Valid = false;
+};
+
+} // namespace permod
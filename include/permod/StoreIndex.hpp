@@ -0,0 +1,34 @@
+//===- permod/StoreIndex.h - Stores of each pointer in a function -*-C++-*-===//
+//
+// Index the stores of a function by the pointer operand, so that tracing a
+// load back to its stores doesn't rescan the function. The index is kept in
+// the ConditionInfo of the function.
+//
+
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+using namespace llvm;
+
+namespace permod {
+
+class StoreIndex {
+public:
+  StoreIndex() = default;
+  explicit StoreIndex(Function &F);
+
+  /* Stores to the pointer, in program order within each block */
+  ArrayRef<StoreInst *> getStores(Value *Ptr) const;
+  /* The last store to the pointer in the block, or nullptr */
+  StoreInst *getLastStore(Value *Ptr, BasicBlock &BB) const;
+
+private:
+  DenseMap<Value *, SmallVector<StoreInst *, 2>> Stores;
+};
+
+} // namespace permod
@@ -1,32 +1,359 @@
 import csv
 import argparse
+import functools
+import subprocess
+
+# Record field tags (see Permod/rtlib/rtlib.c)
+REC_DENSE = 0x01
+REC_SPARSE = 0x02
+REC_RETADDR = 0x03
+REC_CALLEE = 0x04
+REC_VALUES = 0x05
+REC_CASES = 0x06
+REC_HISTORY = 0x07
+REC_PATH = 0x08
+
+
+def read_varint(buf, pos):
+    val = 0
+    shift = 0
+    while pos < len(buf):
+        byte = buf[pos]
+        pos += 1
+        val |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    return val, pos
+
+
+def decode_record(record):
+    """Decode a hex record into a dict of fields"""
+    fields = {"ext": 0, "dst": 0, "truncated": record.endswith("+")}
+    buf = bytes.fromhex(record.rstrip("+"))
+    pos = 0
+    while pos < len(buf):
+        tag = buf[pos]
+        pos += 1
+        if tag == REC_DENSE:
+            nbytes, pos = read_varint(buf, pos)
+            fields["ext"] = int.from_bytes(buf[pos:pos + nbytes], "little")
+            pos += nbytes
+            fields["dst"] = int.from_bytes(buf[pos:pos + nbytes], "little")
+            pos += nbytes
+        elif tag == REC_SPARSE:
+            count, pos = read_varint(buf, pos)
+            nth = 0
+            for _ in range(count):
+                val, pos = read_varint(buf, pos)
+                nth += val >> 1
+                fields["ext"] |= 1 << nth
+                fields["dst"] |= (val & 1) << nth
+        elif tag == REC_RETADDR:
+            fields["retaddr"], pos = read_varint(buf, pos)
+        elif tag == REC_CALLEE:
+            fields["callee"], pos = read_varint(buf, pos)
+        elif tag == REC_VALUES:
+            count, pos = read_varint(buf, pos)
+            fields["values"] = []
+            for _ in range(count):
+                val, pos = read_varint(buf, pos)
+                fields["values"].append((val >> 1) ^ -(val & 1))
+        elif tag == REC_CASES:
+            nbytes, pos = read_varint(buf, pos)
+            fields["cases"] = buf[pos:pos + nbytes]
+            pos += nbytes
+        elif tag == REC_HISTORY:
+            count, pos = read_varint(buf, pos)
+            fields["history"] = []
+            for _ in range(count):
+                iters, pos = read_varint(buf, pos)
+                outcomes, pos = read_varint(buf, pos)
+                fields["history"].append((iters, outcomes))
+        elif tag == REC_PATH:
+            fields["path"], pos = read_varint(buf, pos)
+        else:
+            # Unknown field: the rest cannot be parsed
+            break
+    return fields
+
+
+def get_text_base(binary):
+    """Address of the first loadable segment, which the runtime uses as base"""
+    out = subprocess.run(["readelf", "-lW", binary],
+                         capture_output=True, text=True).stdout
+    for line in out.splitlines():
+        cols = line.split()
+        if cols and cols[0] == "LOAD":
+            return int(cols[2], 16)
+    return 0
+
+
+@functools.lru_cache(maxsize=None)
+def symbolize(binary, addr):
+    """Resolve an address to 'function (file:line)' with addr2line"""
+    out = subprocess.run(["addr2line", "-f", "-C", "-e", binary, hex(addr)],
+                         capture_output=True, text=True).stdout.split("\n")
+    if len(out) < 2 or out[0] == "??":
+        return hex(addr)
+    return f"{out[0]} ({out[1]})"
+
+
+def parse_extra(extra):
+    """Split ExtraInfo into 'key=value' pairs and the free text"""
+    info = {}
+    rest = []
+    for item in extra.split(";"):
+        key, sep, val = item.partition("=")
+        if sep and key in ("vals", "case", "cases", "hist", "bb", "dag",
+                           "implied", "mask", "dst", "rec", "paths"):
+            info[key] = val
+        elif item:
+            rest.append(item)
+    return info, ";".join(rest)
+
+
+def format_history(hist, reverse):
+    """Outcomes of a branch in a loop, oldest first"""
+    iters, outcomes = hist
+    taken = []
+    for i in reversed(range(min(iters, 32))):
+        taken.append("T" if ((outcomes >> i) & 1) != reverse else "F")
+    return f"{iters} iterations, last: {' '.join(taken)}"
+
+
+def parse_dag(dag):
+    """'<block>><succ>@<val>,... ...' into {block: [(succ, val), ...]}"""
+    edges = {}
+    for item in dag.split():
+        block, _, succs = item.partition(">")
+        for succ_val in succs.split(","):
+            succ, _, val = succ_val.partition("@")
+            edges.setdefault(int(block), []).append((int(succ), int(val)))
+    return edges
+
+
+def decode_path(edges, path_id):
+    """Follow the Ball-Larus path ID from the entry, {block: taken successor}"""
+    taken = {}
+    block = 0
+    while block in edges:
+        # The successor with the largest value not exceeding the rest
+        succ, val = max((e for e in edges[block] if e[1] <= path_id),
+                        key=lambda e: e[1])
+        path_id -= val
+        taken[block] = succ
+        block = succ
+    return taken
+
+
+def reason_slot(key, seed, bits):
+    """Multiplicative hash of the (mask, dst) pair into 2**bits slots"""
+    mask, dst = key
+    x = (mask * 0x9e3779b97f4a7c15 + seed) & 0xffffffffffffffff
+    x = ((x ^ dst) * 0xbf58476d1ce4e5b9) & 0xffffffffffffffff
+    x ^= x >> 31
+    return x >> (64 - bits) if bits else 0
+
+
+def merge_reasons(reasons):
+    """Merge the reasons with the same recorded part, as the pass does"""
+    merged = {}
+    for reason in reasons:
+        other = merged.setdefault(reason["rec"], reason)
+        if other is reason:
+            continue
+        mask = other["key"][0] & reason["key"][0]
+        mask &= ~(other["key"][1] ^ reason["key"][1])
+        other["key"] = (mask, other["key"][1] & mask)
+        if other["line"] != reason["line"]:
+            other["line"] = "0"
+        other["paths"] += reason["paths"]
+    return list(merged.values())
+
+
+def build_reason_table(reasons):
+    """Perfect hash of the recorded part of the reasons: (seed, bits, slots)"""
+    # No seed separates two equal keys
+    if len({reason["rec"] for reason in reasons}) != len(reasons):
+        raise ValueError("reasons with the same recorded conditions")
+    bits = max(len(reasons) - 1, 0).bit_length()
+    while True:
+        for seed in range(1024):
+            slots = [None] * (1 << bits)
+            for reason in reasons:
+                slot = reason_slot(reason["rec"], seed, bits)
+                if slots[slot]:
+                    break
+                slots[slot] = reason
+            else:
+                return seed, bits, slots
+        bits += 1
+
+
+def lookup_reason(table, flagA, flagB):
+    """The reason whose recorded conditions match the flags, or None"""
+    seed, bits, slots, used = table
+    key = (flagA & used, flagB & flagA & used)
+    reason = slots[reason_slot(key, seed, bits)]
+    return reason if reason and reason["rec"] == key else None
+
+
+def format_reason(reason, entries):
+    outcomes = []
+    for i in range(reason["key"][0].bit_length()):
+        if not (reason["key"][0] >> i) & 1 or i not in entries:
+            continue
+        entry = entries[i]
+        taken = (reason["key"][1] >> i) & 1
+        if entry["EventType"] == "if-reverse":
+            taken = not taken
+        cond = f"#{entry['Line']} {entry['Content']}".rstrip()
+        if entry["EventType"] == "switch":
+            outcomes.append(f"{cond} (switch)")
+        else:
+            outcomes.append(f"{cond} ({'True' if taken else 'False'})")
+    where = f" at line {reason['line']}" if reason["line"] != "0" else ""
+    if reason["paths"] > 1:
+        where += f" on one of {reason['paths']} paths"
+    if not outcomes:
+        return f"returned{where} on every call"
+    return f"returned{where} because {', '.join(outcomes)}"
+
+
+def c_int(text):
+    """Parse a C integer literal, or return None"""
+    text = text.strip().strip("()").rstrip("uUlL")
+    try:
+        if len(text) > 1 and text[0] == "0" and text[1] not in "xXbB":
+            return int(text, 8)
+        return int(text, 0)
+    except ValueError:
+        return None
+
+
+def get_case_label(func, value):
+    """Find the source text of the case from Macker's `case` rows"""
+    for row in macker_cases.get(func, []):
+        if c_int(row["ExtraInfo"] or row["Content"]) == value:
+            return row["Content"]
+    return None
+
+
+def format_case(info, cases, idx=None):
+    if idx is None:
+        offset, _, width = info["case"].partition("/")
+        offset = int(offset)
+        width = int(width or 1)
+        if offset + width > len(cases):
+            return "unknown case"
+        idx = int.from_bytes(cases[offset:offset + width], "little")
+    consts = info.get("cases", "").split()
+    if idx == 0:
+        return "default"
+    if idx > len(consts):
+        return f"case #{idx}"
+    value = int(consts[idx - 1])
+    label = get_case_label(func, value)
+    return f"case {label} ({value})" if label else f"case {value}"
+
 
 # Set up argument parser
 parser = argparse.ArgumentParser(description="Process log and CSV files.")
 parser.add_argument("csv_file", help="Path to the input CSV file")
 parser.add_argument("log_file", help="Path to the input log file")
+parser.add_argument("--binary",
+                    help="vmlinux or user binary to symbolize addresses")
+parser.add_argument("--macker", help="Path to the CSV file of Macker")
 args = parser.parse_args()
+text_base = get_text_base(args.binary) if args.binary else 0
+
+
+def format_addr(offset, is_retaddr=True):
+    if not args.binary:
+        return f"+{offset:#x}"
+    # The return address points after the call, step back into it
+    if is_retaddr:
+        offset -= 1
+    return symbolize(args.binary, text_base + offset)
+
 
 # Read CSV: Sort by ID for each function and store
 csv_entries = {}
+func_ids = {}
+func_dags = {}
+func_reasons = {}
+func_recorded = {}
 with open(args.csv_file, newline='') as f:
     reader = csv.DictReader(f)
     for row in reader:
         key = (row["File"].strip(), row["Function"].strip())
         csv_entries.setdefault(key, {})
-        csv_entries[key][int(row["ID"])] = row  # Convert ID to int and use it
+        if row["EventType"] == "reason":
+            info, _ = parse_extra(row["ExtraInfo"])
+            func_reasons.setdefault(key, []).append(
+                {"line": row["Line"],
+                 "key": (int(info["mask"], 16), int(info["dst"], 16)),
+                 "paths": int(info.get("paths", 1))})
+        elif row["EventType"] != "return":
+            csv_entries[key][int(row["ID"])] = row  # Convert ID to int and use it
+        else:
+            info, _ = parse_extra(row["ExtraInfo"])
+            if "dag" in info:
+                func_dags[key] = parse_dag(info["dag"])
+            if "rec" in info:
+                func_recorded[key] = int(info["rec"], 16)
+        if row.get("FuncID"):
+            func_ids.setdefault(int(row["FuncID"], 16), set()).add(key)
 
-# Read logs (format: [hoge],filename,func,retval,flagA,flagB)
+# A record maps to its reason with one lookup
+reason_tables = {}
+for key, reasons in func_reasons.items():
+    # Rows of a function logged twice
+    reasons = list({r["key"]: r for r in reversed(reasons)}.values())
+    used = functools.reduce(lambda acc, r: acc | r["key"][0], reasons, 0)
+    # Only these conditions are in the flags, e.g., with REASON_MODE
+    used &= func_recorded.get(key, used)
+    for reason in reasons:
+        reason["rec"] = (reason["key"][0] & used, reason["key"][1] & used)
+    # Logs of older builds may have reasons the flags can't tell apart
+    reasons = merge_reasons(reasons)
+    reason_tables[key] = build_reason_table(reasons) + (used,)
+
+# Read Macker CSV: `case` rows for each function
+macker_cases = {}
+if args.macker:
+    with open(args.macker, newline='') as f:
+        for row in csv.DictReader(f):
+            if row["EventType"] == "case":
+                macker_cases.setdefault(row["Function"].strip(), []).append(row)
+
+# Read logs (format: [hoge],funcid,retval,record)
+# Old logs (format: [hoge],filename,func,retval,record or
+# [hoge],filename,func,retval,flagA,flagB) are also accepted
 with open(args.log_file) as f:
     for line in f:
         # Split log line by commas
         parts = line.strip().split(",")
-        if len(parts) != 6:
+        if len(parts) not in (4, 5, 6):
             continue
 
         # Assign each part to a variable
-        _, file, func, retval, flagA_str, flagB_str = parts
-        key = (file.strip(), func.strip())
+        if len(parts) == 4:
+            _, funcid, retval, rawrecord = parts
+            try:
+                keys = func_ids.get(int(funcid, 16), set())
+            except ValueError:
+                continue
+            if len(keys) != 1:
+                print(f"FuncID {'collides' if keys else 'not found'} in CSV: {funcid}")
+                continue
+            key = next(iter(keys))
+            file, func = key
+        else:
+            _, file, func, retval = parts[:4]
+            rawrecord = parts[4]
+            key = (file.strip(), func.strip())
 
         # If the key does not exist in the CSV
         if key not in csv_entries:
@@ -34,15 +361,70 @@ with open(args.log_file) as f:
             continue
 
         try:
-            # Read flags as hexadecimal
-            flagA = int(flagA_str, 16)
-            flagB = int(flagB_str, 16)
+            if len(parts) == 6:
+                # Read flags as hexadecimal
+                flagA = int(parts[4], 16)
+                flagB = int(parts[5], 16)
+                record = {}
+            else:
+                record = decode_record(rawrecord)
+                flagA = record["ext"]
+                flagB = record["dst"]
         except ValueError:
             # Skip if the flags are invalid
             continue
 
-        # Check IDs from 0 to 63 (extend as needed)
-        for i in range(64):
+        # Branches on the path are recorded as if they had flags
+        path_cases = {}
+        if "path" in record and key in func_dags:
+            taken = decode_path(func_dags[key], record["path"])
+            for i, entry in csv_entries[key].items():
+                info, _ = parse_extra(entry['ExtraInfo'])
+                if "bb" not in info:
+                    continue
+                block, _, succs = info["bb"].partition(">")
+                if int(block) not in taken:
+                    continue
+                succs = [int(succ) for succ in succs.split(",")]
+                flagA |= 1 << i
+                # Like the runtime, the taken case is not in the flags
+                if succs[0] == taken[int(block)] and \
+                        entry['EventType'] != "switch":
+                    flagB |= 1 << i
+                # Cases to the same block can't be told apart
+                path_cases[i] = [idx for idx, succ in enumerate(succs)
+                                 if succ == taken[int(block)]]
+
+        reason = None
+        if key in reason_tables:
+            reason = lookup_reason(reason_tables[key], flagA, flagB)
+        # Conditions not recorded are restored from the path of the reason
+        if reason:
+            flagA |= reason["key"][0]
+            flagB |= reason["key"][1]
+
+        # Outcomes implied by a recorded dominating branch, which the pass
+        # only leaves out if the branch runs whenever that outcome is taken
+        for i, entry in sorted(csv_entries[key].items()):
+            info, _ = parse_extra(entry['ExtraInfo'])
+            if "implied" not in info:
+                continue
+            by, by_outcome, outcome = map(int, info["implied"].split(":"))
+            if (flagA >> by) & 1 and ((flagB >> by) & 1) == by_outcome:
+                flagA |= 1 << i
+                flagB |= outcome << i
+
+        # Output the file name and function name first
+        print(f"-- {file}::{func}() returned {retval} --")
+        if "retaddr" in record:
+            print(f"  called from {format_addr(record['retaddr'])}")
+        if "callee" in record:
+            print(f"  denied by {format_addr(record['callee'], False)}")
+        if reason:
+            print(f"  {format_reason(reason, csv_entries[key])}")
+
+        # Check IDs of all the recorded conditions
+        for i in range(flagA.bit_length()):
             # Skip if the corresponding bit in flagA is 0
             if not ((flagA >> i) & 1):
                 continue
@@ -50,15 +432,32 @@ with open(args.log_file) as f:
             # Retrieve the CSV entry
             entry = csv_entries[key].get(i)
             if entry:
-                # Output the file name and function name first
-                if i == 0:
-                    print(f"-- {entry['File']}::{entry['Function']}() returned {retval} --")  # Output file name and function name
                 # Output line number and content
-                if entry['EventType'] == "if":
+                if entry['EventType'] in ("if", "select"):
                     print(f"[#{entry['Line']}] {entry['Content']} ({'True' if ((flagB >> i) & 1) else 'False'})")
                 elif entry['EventType'] == "if-reverse":
                     print(f"[#{entry['Line']}] {entry['Content']} ({'False' if ((flagB >> i) & 1) else 'True'})")
-                elif entry['EventType'] == "switch":
-                    print(f"[#{entry['Line']}] {entry['Content']} (switch)")
-                if entry['ExtraInfo']:
-                    print(f"  >> {entry['ExtraInfo']}")
\ No newline at end of file
+                info, extra = parse_extra(entry['ExtraInfo'])
+                if "implied" in info:
+                    by = csv_entries[key].get(int(info["implied"].split(":")[0]))
+                    print(f"  implied by #{by['Line'] if by else '?'}")
+                if entry['EventType'] == "switch":
+                    taken = "switch"
+                    if i in path_cases:
+                        taken = " or ".join(format_case(info, b"", idx)
+                                            for idx in path_cases[i])
+                    elif "case" in info and "ext" in record:
+                        taken = format_case(info, record.get("cases", b""))
+                    print(f"[#{entry['Line']}] {entry['Content']} ({taken})")
+                values = record.get("values", [])
+                for name_slot in info.get("vals", "").split():
+                    name, _, slot = name_slot.rpartition(":")
+                    if int(slot) < len(values):
+                        val = values[int(slot)]
+                        print(f"  {name} = {val} ({val & 0xffffffffffffffff:#x})")
+                history = record.get("history", [])
+                if "hist" in info and int(info["hist"]) < len(history):
+                    reverse = entry['EventType'] == "if-reverse"
+                    print(f"  {format_history(history[int(info['hist'])], reverse)}")
+                if extra:
+                    print(f"  >> {extra}")